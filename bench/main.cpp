@@ -0,0 +1,183 @@
+#include <shpp/shpp.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Spawn latency, pipe throughput and capture paths, each sample reported as p50/p99.
+// SHPP_BENCH_RSS_MB (default 512) sizes the ballast for the large-parent spawn runs,
+// SHPP_BENCH_MAX_MB (default 1024) the largest payload.
+
+using namespace shpp;
+using Clock = std::chrono::steady_clock;
+
+static size_t env_mb(const char *name, size_t fallback)
+{
+  const char *v = std::getenv(name);
+  return v && *v ? size_t(std::strtoull(v, nullptr, 10)) : fallback;
+}
+
+// One line per benchmark: p50/p99 of the samples, and the MB/s at p50 when bytes moved
+static void report(const std::string &name, std::vector<Clock::duration> samples, size_t bytes = 0)
+{
+  std::sort(samples.begin(), samples.end());
+  auto us = [](Clock::duration d) { return std::chrono::duration<double, std::micro>(d).count(); };
+  const double p50 = us(samples[samples.size() / 2]);
+  const double p99 = us(samples[std::min(samples.size() - 1, samples.size() * 99 / 100)]);
+  std::printf("%-48s p50 %11.1f us   p99 %11.1f us", name.c_str(), p50, p99);
+  if (bytes > 0)
+    std::printf("   %9.1f MB/s", double(bytes) / p50);
+  std::printf("\n");
+}
+
+// Runs fn() once to warm up, then `reps` times; fn returns the time it measured
+template <class Fn>
+static void bench(const std::string &name, size_t reps, size_t bytes, Fn &&fn)
+{
+  fn();
+  std::vector<Clock::duration> samples;
+  samples.reserve(reps);
+  for (size_t i = 0; i < reps; ++i)
+    samples.push_back(fn());
+  report(name, std::move(samples), bytes);
+}
+
+static Clock::duration timed(Pending &&p)
+{
+  const auto t0 = Clock::now();
+  p.run();
+  return Clock::now() - t0;
+}
+
+// `true | true | ...`, depth stages
+static Pending trues(size_t depth, Spawn backend)
+{
+  Pending p = (CC % "true").spawn(backend);
+  for (size_t i = 1; i < depth; ++i)
+    p = std::move(p) | "true";
+  return p;
+}
+
+static std::string size_name(size_t n)
+{
+  return n >= (1u << 30) ? std::to_string(n >> 30) + " GiB"
+         : n >= (1u << 20) ? std::to_string(n >> 20) + " MiB"
+                           : std::to_string(n >> 10) + " KiB";
+}
+
+int main()
+{
+  const std::pair<Spawn, const char *> backends[] = {
+    {Spawn::Fork, "fork"}, {Spawn::PosixSpawn, "posix_spawn"}, {Spawn::Server, "server"}};
+  start_spawn_server(); // while the process is still small: that's the point of it
+
+  // Spawn latency
+  std::cout << "\n---------------------\n";
+  for (auto [backend, name] : backends)
+    for (size_t depth : {size_t(1), size_t(2), size_t(8)})
+      bench(std::string("spawn true x") + std::to_string(depth) + " [" + name + "]", 200, 0,
+            [&] { return timed(trues(depth, backend)); });
+
+  {
+    // ...from a parent with a large RSS: fork() copies its page tables, posix_spawn doesn't
+    std::cout << "\n---------------------\n";
+    const size_t mb = env_mb("SHPP_BENCH_RSS_MB", 512);
+    std::vector<char> ballast(mb << 20, 1); // touched, so it is resident
+    for (auto [backend, name] : backends)
+      bench("spawn true, " + std::to_string(mb) + " MiB parent [" + name + "]", 100, 0,
+            [&] { return timed(trues(1, backend)); });
+    std::printf("(ballast %d)\n", ballast[ballast.size() / 2]);
+  }
+
+  // Feed and capture throughput through `cat`
+  std::cout << "\n---------------------\n";
+  const size_t max = env_mb("SHPP_BENCH_MAX_MB", 1024) << 20;
+  for (size_t n = 1 << 10; n <= max; n <<= 5)
+  {
+    const std::string payload(n, 'x');
+    const size_t reps = std::clamp<size_t>((256u << 20) / n, 3, 200);
+    const std::string sz = size_name(n);
+    std::string out;
+    bench("InString -> cat -> into    " + sz, reps, n, [&] {
+      out.clear();
+      Pending p = SC{into(out)} % in(std::string(payload)) | "cat"; // the copy isn't timed
+      return timed(std::move(p));
+    });
+    bench("InView   -> cat -> into    " + sz, reps, n, [&] {
+      out.clear();
+      return timed(SC{into(out)} % in(std::string_view(payload)) | "cat");
+    });
+    bench("InStream -> cat -> into    " + sz, reps, n, [&] {
+      out.clear();
+      std::istringstream is(payload);
+      return timed(SC{into(out)} % in(is) | "cat");
+    });
+    bench("InView   -> cat -> SS_t os " + sz, reps, n, [&] {
+      std::ostringstream os, es;
+      return timed(SS{os, es} % in(std::string_view(payload)) | "cat");
+    });
+    bench("InView   -> cat -> fd      " + sz, reps, n, [&] {
+      return timed(SC{to_file("/dev/null")} % in(std::string_view(payload)) | "cat");
+    });
+  }
+
+  {
+    // Concurrent launches: N threads, each starting pipelines back to back
+    std::cout << "\n---------------------\n";
+    for (size_t threads : {size_t(1), size_t(4), size_t(16)})
+      for (auto [backend, name] : backends)
+      {
+        std::vector<std::vector<Clock::duration>> per(threads);
+        std::vector<std::thread> ts;
+        const auto t0 = Clock::now();
+        for (auto &samples : per)
+          ts.emplace_back([&samples, backend = backend] {
+            for (int i = 0; i < 100; ++i)
+              samples.push_back(timed(trues(1, backend)));
+          });
+        for (auto &t : ts)
+          t.join();
+        const double secs = std::chrono::duration<double>(Clock::now() - t0).count();
+        std::vector<Clock::duration> all;
+        for (auto &samples : per)
+          all.insert(all.end(), samples.begin(), samples.end());
+        const auto rate = std::to_string(long(double(all.size()) / secs));
+        report(std::to_string(threads) + " threads x 100 [" + name + "] " + rate + "/s", std::move(all));
+      }
+  }
+
+  {
+    // 64 pipelines of 1 MiB each, 8 at a time: one thread per pipeline vs parallel()'s event loop
+    std::cout << "\n---------------------\n";
+    constexpr size_t jobs = 64, width = 8;
+    std::vector<std::string> outs(jobs);
+    auto job = [&](size_t i) {
+      outs[i].clear();
+      return SC{into(outs[i])} % "head -c 1048576 /dev/zero";
+    };
+    bench("64 x 1 MiB, 8 threads", 10, jobs << 20, [&] {
+      const auto t0 = Clock::now();
+      std::vector<std::thread> ts;
+      for (size_t t = 0; t < width; ++t)
+        ts.emplace_back([&, t] {
+          for (size_t i = t; i < jobs; i += width)
+            job(i).run();
+        });
+      for (auto &t : ts)
+        t.join();
+      return Clock::now() - t0;
+    });
+    bench("64 x 1 MiB, parallel(8)", 10, jobs << 20, [&] {
+      const auto t0 = Clock::now();
+      std::vector<Pending> ps;
+      for (size_t i = 0; i < jobs; ++i)
+        ps.push_back(job(i));
+      parallel(std::move(ps), width);
+      return Clock::now() - t0;
+    });
+  }
+}
@@ -1,8 +1,22 @@
 #include "shpp.hpp"
+#include <algorithm>
 #include <atomic>
 #include <cerrno>
+#include <cstdint>
+#include <climits>
+#include <condition_variable>
 #include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
 #include <fcntl.h>
+#include <mutex>
+#include <poll.h>
+#include <random>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -10,9 +24,59 @@
 #include <system_error>
 #include <thread>
 #include <unistd.h>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#ifndef SHPP_HAVE_POSIX_SPAWN // build with -DSHPP_HAVE_POSIX_SPAWN=0 to compile the fork path only
+#if defined(_POSIX_SPAWN) && _POSIX_SPAWN > 0
+#define SHPP_HAVE_POSIX_SPAWN 1
+#else
+#define SHPP_HAVE_POSIX_SPAWN 0
+#endif
+#endif
+#if SHPP_HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif
+// posix_spawn_file_actions_addchdir_np (glibc 2.29+, macOS 10.15+); without it, stages
+// with a .cwd() take the fork path
+#if !defined(SHPP_HAVE_SPAWN_CHDIR)
+#if SHPP_HAVE_POSIX_SPAWN &&                                                                        \
+  ((defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))) || defined(__APPLE__))
+#define SHPP_HAVE_SPAWN_CHDIR 1
+#else
+#define SHPP_HAVE_SPAWN_CHDIR 0
+#endif
+#endif
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+// Vectorized fixed-string search for grep(); build with -DSHPP_HAVE_SIMD=0 for the plain one
+#ifndef SHPP_HAVE_SIMD
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+#define SHPP_HAVE_SIMD 1
+#else
+#define SHPP_HAVE_SIMD 0
+#endif
+#endif
+#if SHPP_HAVE_SIMD && defined(__x86_64__)
+#include <immintrin.h>
+#elif SHPP_HAVE_SIMD && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#if defined(__linux__) && defined(SYS_pidfd_open)
+#define SHPP_HAVE_PIDFD 1
+#else
+#define SHPP_HAVE_PIDFD 0
+#endif
+
+extern char **environ;
+
 template <class... Ts>
 struct overloaded : Ts...
 {
@@ -21,614 +85,3598 @@ struct overloaded : Ts...
 template <class... Ts>
 overloaded(Ts...) -> overloaded<Ts...>;
 
-// Extended splitter: quotes, escapes, $VAR/${VAR}, ~ at word start.
-// Throws std::runtime_error on unmatched quotes.
-static inline std::vector<std::string> split_cmd(std::string_view s)
+static inline std::string get_env(std::string_view name)
+{
+  if (name.empty())
+    return {};
+  if (const char *v = std::getenv(std::string(name).c_str()))
+    return std::string(v);
+  return {};
+}
+
+static inline void append_home(std::string &s)
 {
-  enum class State { Unquoted, InSingle, InDouble };
-  State st = State::Unquoted;
+  if (const char *home = std::getenv("HOME"))
+    s.append(home);
+  else
+    s.push_back('~');
+}
 
-  std::vector<std::string> parts;
-  std::string cur;
+// tokenize() sink that expands right away, straight into a Cmd's arena
+struct ExpandNow
+{
+  shpp::Cmd cmd;
+  std::string cur; // reused for every word
 
-  const auto push_token = [&]() {
-    parts.push_back(cur);
+  void ch(char c) { cur.push_back(c); }
+  void var(std::string_view name) { cur += get_env(name); }
+  void home() { append_home(cur); }
+  void end_word()
+  {
+    cmd.arg(cur);
     cur.clear();
-  };
+  }
+};
 
-  auto get_env = [](std::string_view name) -> std::string {
-    if (name.empty())
-      return {};
-    if (const char *v = std::getenv(std::string(name).c_str()))
-      return std::string(v);
-    return {};
-  };
+// tokenize() sink that keeps $VAR / ~ as pieces, for Cmd::expanded() to resolve later
+struct ExpandLater
+{
+  std::vector<shpp::Cmd::Word> words;
+  shpp::Cmd::Word cur;
+  bool dynamic = false; // saw anything that depends on the environment
 
-  auto is_name_start = [](unsigned char c) { return std::isalpha(c) || c == '_'; };
-  auto is_name_char = [](unsigned char c) { return std::isalnum(c) || c == '_'; };
+  void ch(char c)
+  {
+    if (cur.empty() || cur.back().kind != shpp::Cmd::Piece::Text)
+      cur.push_back({shpp::Cmd::Piece::Text, {}});
+    cur.back().text.push_back(c);
+  }
+  void var(std::string_view name)
+  {
+    cur.push_back({shpp::Cmd::Piece::Var, std::string(name)});
+    dynamic = true;
+  }
+  void home()
+  {
+    cur.push_back({shpp::Cmd::Piece::Home, {}});
+    dynamic = true;
+  }
+  void end_word()
+  {
+    words.push_back(std::move(cur));
+    cur.clear();
+  }
+};
 
-  bool in_token = false;     // whether we're currently building a token (even if cur is empty)
-  bool at_word_start = true; // for ~ expansion in unquoted context
+static inline shpp::Cmd split_cmd(std::string_view s)
+{
+  ExpandNow out;
+  shpp::detail::tokenize(s, out);
+  return std::move(out.cmd);
+}
 
-  for (size_t i = 0; i < s.size(); ++i)
-  {
-    char c = s[i];
+static inline void set_cloexec(int fd)
+{
+  int flags = fcntl(fd, F_GETFD);
+  if (flags >= 0)
+    fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
 
-    if (st == State::Unquoted)
-    {
-      if (std::isspace(static_cast<unsigned char>(c)))
-      {
-        if (in_token)
-        {
-          push_token();
-          in_token = false;
-        }
-        at_word_start = true;
-        continue;
-      }
+static inline void make_pipe_cloexec(int fds[2])
+{
+#if defined(__linux__) && defined(O_CLOEXEC)
+  if (::pipe2(fds, O_CLOEXEC) == 0)
+    return;
+    // if pipe2 isn’t supported at runtime, fall through
+#endif
+  if (::pipe(fds) != 0)
+    throw std::system_error(errno, std::generic_category(), "pipe");
+  set_cloexec(fds[0]);
+  set_cloexec(fds[1]);
+}
 
-      if (c == '\'')
-      {
-        st = State::InSingle;
-        in_token = true;
-        at_word_start = false;
-        continue;
-      }
-      if (c == '"')
-      {
-        st = State::InDouble;
-        in_token = true;
-        at_word_start = false;
-        continue;
-      }
+// StageIo slot that is closed in the child instead (in_closed())
+static constexpr int closed_fd = -2;
 
-      if (c == '\\')
-      {
-        in_token = true;
-        at_word_start = false;
-        if (i + 1 < s.size())
-        {
-          cur.push_back(s[++i]);
-        }
-        else
-        {
-          cur.push_back('\\');
-        }
-        continue;
-      }
+// How a stage's stdio is wired; -1 keeps the parent's fd
+struct StageIo
+{
+  int in = -1;
+  int out = -1;
+  int err = -1;
+  const char *cwd = nullptr; // chdir() before exec; nullptr keeps the parent's
+  pid_t pgid = -1;           // process group to join; 0 starts a new one, -1 keeps the parent's
+  bool default_sigpipe = false; // SIGPIPE back to SIG_DFL and nothing blocked (the spawn server ignores it)
+};
 
-      if (c == '~' && at_word_start)
-      {
-        in_token = true;
-        at_word_start = false;
-        if (const char *home = std::getenv("HOME"))
-          cur.append(home);
-        else
-          cur.push_back('~');
-        continue;
-      }
+// Wait status of a process that exited with `code` (same encoding on Linux and the BSDs)
+static constexpr int exited_with(int code)
+{
+  return (code & 0xff) << 8;
+}
 
-      if (c == '$')
-      {
-        in_token = true;
-        at_word_start = false;
-        // ${VAR}
-        if (i + 1 < s.size() && s[i + 1] == '{')
-        {
-          size_t j = i + 2, end = j;
-          while (end < s.size() && s[end] != '}')
-            ++end;
-          if (end >= s.size())
-            throw std::runtime_error("Unclosed ${...} in command");
-          cur += get_env(s.substr(j, end - j));
-          i = end; // skip '}'
-          continue;
-        }
-        // $VAR
-        size_t j = i + 1;
-        if (j < s.size() && is_name_start(static_cast<unsigned char>(s[j])))
-        {
-          ++j;
-          while (j < s.size() && is_name_char(static_cast<unsigned char>(s[j])))
-            ++j;
-          cur += get_env(s.substr(i + 1, j - (i + 1)));
-          i = j - 1;
-        }
-        else
-        {
-          // Not a valid name start; treat '$' literally.
-          cur.push_back('$');
-        }
-        continue;
-      }
+static inline shpp::Spawn resolve_spawn(shpp::Spawn s)
+{
+  if (s != shpp::Spawn::Auto)
+    return s;
+#if SHPP_HAVE_POSIX_SPAWN
+  return shpp::Spawn::PosixSpawn;
+#else
+  return shpp::Spawn::Fork;
+#endif
+}
 
-      // normal char
-      cur.push_back(c);
-      in_token = true;
-      at_word_start = false;
-      continue;
-    }
+// dup2() that also works when the fd already sits on its target slot:
+// dup2(fd, fd) is a no-op and would leave FD_CLOEXEC set.
+static inline void dup_onto(int fd, int target)
+{
+  if (fd == closed_fd)
+    ::close(target);
+  if (fd < 0)
+    return;
+  if (fd == target)
+  {
+    int flags = fcntl(fd, F_GETFD);
+    if (flags >= 0)
+      fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC);
+    return;
+  }
+  ::dup2(fd, target);
+}
+
+// ===== PATH lookup, done once per program instead of by execvp on every launch
+// Keyed by the value of $PATH (shpp's own, which is also what execvp/posix_spawnp
+// search); a changed $PATH drops every entry, a failed exec drops that one.
+struct PathCache
+{
+  std::mutex m;
+  std::string path;
+  std::unordered_map<std::string, std::string> exes; // prog -> absolute path
+
+  static PathCache &get()
+  {
+    static PathCache c;
+    return c;
+  }
 
-    if (st == State::InSingle)
+  // Sets exe to prog's absolute path (reusing exe's buffer), or to "" meaning "let
+  // execvp/posix_spawnp do it": prog has a '/', or wasn't found
+  void lookup(const char *prog, std::string &exe)
+  {
+    exe.clear();
+    if (!*prog || std::strchr(prog, '/'))
+      return;
+    const char *env_path = ::getenv("PATH");
+    std::string_view cur = env_path ? env_path : "/bin:/usr/bin"; // execvp's default
+    std::lock_guard<std::mutex> lk(m);
+    if (cur != path)
     {
-      if (c == '\'')
-      {
-        st = State::Unquoted;
-        continue;
-      }
-      cur.push_back(c); // no escapes, no env expansion
-      in_token = true;
-      continue;
+      path.assign(cur);
+      exes.clear();
     }
-
-    // State::InDouble
-    if (c == '"')
+    if (auto it = exes.find(prog); it != exes.end())
     {
-      st = State::Unquoted;
-      at_word_start = false;
-      continue;
+      exe = it->second;
+      return;
     }
-    if (c == '\\')
+    std::string cand;
+    for (size_t b = 0; b <= path.size();)
     {
-      if (i + 1 < s.size())
-      {
-        cur.push_back(s[++i]);
-      }
-      else
+      size_t e = path.find(':', b);
+      if (e == std::string::npos)
+        e = path.size();
+      cand.assign(path, b, e - b);
+      if (cand.empty() || cand[0] != '/')
+        return; // relative entries depend on the (stage's) cwd: leave them to execvp
+      cand += '/';
+      cand += prog;
+      struct stat st;
+      if (::stat(cand.c_str(), &st) == 0 && S_ISREG(st.st_mode) && ::access(cand.c_str(), X_OK) == 0)
       {
-        cur.push_back('\\');
+        exe = exes.emplace(prog, cand).first->second;
+        return;
       }
-      in_token = true;
-      continue;
+      b = e + 1;
+    }
+  }
+
+  void forget(const char *prog)
+  {
+    std::lock_guard<std::mutex> lk(m);
+    exes.erase(prog);
+  }
+};
+
+// Classic fork + execve of the resolved path; the child only dup2s and execs (every
+// other fd is CLOEXEC). If that exec fails the child retries with execvp, which also
+// covers scripts without a #! line.
+static inline pid_t spawn_fork(const shpp::Cmd &c, const char *exe, char *const *envp, const StageIo &io)
+{
+  pid_t pid = ::fork();
+  if (pid < 0)
+    throw std::system_error(errno, std::generic_category(), "fork");
+  if (pid == 0)
+  {
+    // ---- Child ----
+    if (io.pgid >= 0)
+      ::setpgid(0, io.pgid);
+    if (io.default_sigpipe)
+    {
+      struct sigaction sa{};
+      sa.sa_handler = SIG_DFL;
+      ::sigaction(SIGPIPE, &sa, nullptr);
+      sigset_t none;
+      sigemptyset(&none);
+      ::sigprocmask(SIG_SETMASK, &none, nullptr);
     }
-    if (c == '$')
+    dup_onto(io.in, STDIN_FILENO);
+    dup_onto(io.out, STDOUT_FILENO);
+    dup_onto(io.err, STDERR_FILENO);
+    if (io.cwd && ::chdir(io.cwd) != 0)
     {
-      // env expansion allowed in double quotes
-      if (i + 1 < s.size() && s[i + 1] == '{')
-      {
-        size_t j = i + 2, end = j;
-        while (end < s.size() && s[end] != '}')
-          ++end;
-        if (end >= s.size())
-          throw std::runtime_error("Unclosed ${...} in command");
-        cur += get_env(s.substr(j, end - j));
-        i = end;
-      }
-      else
-      {
-        size_t j = i + 1;
-        if (j < s.size() && is_name_start(static_cast<unsigned char>(s[j])))
-        {
-          ++j;
-          while (j < s.size() && is_name_char(static_cast<unsigned char>(s[j])))
-            ++j;
-          cur += get_env(s.substr(i + 1, j - (i + 1)));
-          i = j - 1;
-        }
-        else
-        {
-          cur.push_back('$');
-        }
-      }
-      in_token = true;
-      continue;
+      std::fprintf(stderr, "chdir(%s) failed: %s\n", io.cwd, std::strerror(errno));
+      _exit(127);
     }
-    // normal char inside double quotes
-    cur.push_back(c);
-    in_token = true;
+
+    if (exe)
+      ::execve(exe, c.argv(), envp ? envp : environ);
+    if (envp)
+      environ = const_cast<char **>(envp);
+    ::execvp(c.prog(), c.argv());
+    std::fprintf(stderr, "execvp(%s) failed: %s\n", c.prog(), std::strerror(errno));
+    _exit(127);
+  }
+  if (io.pgid >= 0)
+    ::setpgid(pid, io.pgid ? io.pgid : pid); // also here, so it holds before we signal the group
+  return pid;
+}
+
+#if SHPP_HAVE_POSIX_SPAWN
+// posix_spawn launch: vfork-style on glibc/musl (clone(CLONE_VM|CLONE_VFORK)) and a
+// syscall on macOS, so its cost doesn't grow with the parent's RSS.
+// Runs the resolved `exe` when there is one; if that fails with ENOENT/ENOEXEC the
+// cache entry is stale (or the file is a #!-less script) and posix_spawnp gets a go.
+// Returns -1 if the program couldn't be exec'd, after reporting it the way the fork
+// child would (message on the stage's stderr; the stage then counts as exit 127).
+static inline pid_t spawn_posix(const shpp::Cmd &c, const char *exe, char *const *envp, const StageIo &io)
+{
+  posix_spawn_file_actions_t fa;
+  if (int e = ::posix_spawn_file_actions_init(&fa))
+    throw std::system_error(e, std::generic_category(), "posix_spawn_file_actions_init");
+
+  int e = 0;
+  const int fds[3] = {io.in, io.out, io.err};
+  for (int target = 0; target < 3 && e == 0; ++target)
+    if (fds[target] >= 0)
+      e = ::posix_spawn_file_actions_adddup2(&fa, fds[target], target);
+    else if (fds[target] == closed_fd)
+      e = ::posix_spawn_file_actions_addclose(&fa, target);
+#if SHPP_HAVE_SPAWN_CHDIR
+  if (e == 0 && io.cwd)
+    e = ::posix_spawn_file_actions_addchdir_np(&fa, io.cwd);
+#endif
+  posix_spawnattr_t attr;
+  const bool use_attr = io.pgid >= 0 || io.default_sigpipe;
+  if (use_attr && e == 0 && (e = ::posix_spawnattr_init(&attr)) != 0)
+  {
+    ::posix_spawn_file_actions_destroy(&fa);
+    throw std::system_error(e, std::generic_category(), "posix_spawnattr_init");
   }
+  short flags = 0;
+  if (io.pgid >= 0)
+    flags |= POSIX_SPAWN_SETPGROUP;
+  if (io.default_sigpipe)
+    flags |= POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+  if (use_attr && e == 0)
+    e = ::posix_spawnattr_setflags(&attr, flags);
+  if (use_attr && e == 0 && io.pgid >= 0)
+    e = ::posix_spawnattr_setpgroup(&attr, io.pgid);
+  if (use_attr && e == 0 && io.default_sigpipe)
+  {
+    sigset_t def, none;
+    sigemptyset(&def);
+    sigaddset(&def, SIGPIPE);
+    sigemptyset(&none);
+    e = ::posix_spawnattr_setsigdefault(&attr, &def);
+    if (e == 0)
+      e = ::posix_spawnattr_setsigmask(&attr, &none);
+  }
+  const posix_spawnattr_t *ap = use_attr ? &attr : nullptr;
 
-  if (st == State::InSingle)
-    throw std::runtime_error("Unclosed single quote in command");
-  if (st == State::InDouble)
-    throw std::runtime_error("Unclosed double quote in command");
+  pid_t pid = -1;
+  char *const *ep = envp ? envp : environ;
+  bool search = !exe;
+  if (e == 0 && exe)
+  {
+    e = ::posix_spawn(&pid, exe, &fa, ap, c.argv(), ep);
+    if (e == ENOENT || e == ENOEXEC)
+    {
+      PathCache::get().forget(c.prog());
+      search = true;
+      e = 0;
+    }
+  }
+  if (e == 0 && search)
+    e = ::posix_spawnp(&pid, c.prog(), &fa, ap, c.argv(), ep);
+  ::posix_spawn_file_actions_destroy(&fa);
+  if (use_attr)
+    ::posix_spawnattr_destroy(&attr);
 
-  if (in_token)
-    push_token();
-  return parts;
+  switch (e)
+  {
+  case 0: return pid;
+  case ENOENT:
+  case EACCES:
+  case ENOEXEC:
+  case ENOTDIR:
+  case ELOOP:
+  case ENAMETOOLONG:
+  case E2BIG:
+    if (io.cwd && ::access(io.cwd, X_OK) != 0) // the chdir action failed, not the exec
+      ::dprintf(io.err >= 0 ? io.err : STDERR_FILENO, "chdir(%s) failed: %s\n", io.cwd, std::strerror(e));
+    else
+      ::dprintf(io.err >= 0 ? io.err : STDERR_FILENO, "execvp(%s) failed: %s\n", c.prog(), std::strerror(e));
+    return -1;
+  default: throw std::system_error(e, std::generic_category(), "posix_spawnp");
+  }
 }
+#endif
 
-static inline void set_cloexec(int fd)
+static inline void set_nonblock(int fd)
 {
-  int flags = fcntl(fd, F_GETFD);
+  int flags = fcntl(fd, F_GETFL);
   if (flags >= 0)
-    fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
-static inline void make_pipe_cloexec(int fds[2])
+// open() for redirections: O_CLOEXEC, so only the dup2'd copy reaches the child
+static inline shpp::detail::Fd open_redirect(const std::string &path, int flags)
 {
-#if defined(__linux__) && defined(O_CLOEXEC)
-  if (::pipe2(fds, O_CLOEXEC) == 0)
-    return;
-    // if pipe2 isn’t supported at runtime, fall through
+  int fd;
+  do
+    fd = ::open(path.c_str(), flags | O_CLOEXEC, 0666);
+  while (fd < 0 && errno == EINTR);
+  if (fd < 0)
+    throw std::system_error(errno, std::generic_category(), "open " + path);
+  return shpp::detail::Fd(fd);
+}
+
+// /dev/null (to_null(), in_null(), Stderr::Null), opened once for the whole process
+static inline int dev_null()
+{
+  static const int fd = open_redirect("/dev/null", O_RDWR).release();
+  return fd;
+}
+
+// ===== Spawn server (Spawn::Server)
+// A helper process forked by start_spawn_server() while the parent is still small, so
+// launching costs the same however big or threaded the parent gets later. Requests go
+// over a stream socket: a length-prefixed payload (per stage: which of stdin/stdout/stderr
+// are set, exe, cwd and argv; then the env block) with the job's reply socket and the
+// stages' stdio fds attached as SCM_RIGHTS. With the own-group flag the stages go
+// into a new process group led by the first one that starts, as launch() does. The server launches the stages, answers on
+// the reply socket with {errno, pid...} and then sends one {stage, wait status} per exit.
+#if defined(MSG_NOSIGNAL)
+static constexpr int send_flags = MSG_NOSIGNAL;
+#else
+static constexpr int send_flags = 0; // the server ignores SIGPIPE; so should a parent that outlives it
 #endif
-  if (::pipe(fds) != 0)
-    throw std::system_error(errno, std::generic_category(), "pipe");
-  set_cloexec(fds[0]);
-  set_cloexec(fds[1]);
+static constexpr size_t max_server_fds = 253; // SCM_MAX_FD on Linux
+
+struct Wire
+{
+  std::string b;
+  size_t at = 0;
+  bool ok = true; // false once a read ran past the end
+
+  void put(uint32_t v) { b.append(reinterpret_cast<const char *>(&v), sizeof v); }
+  void put(std::string_view s)
+  {
+    put(uint32_t(s.size()));
+    b.append(s);
+  }
+  uint32_t get_u32()
+  {
+    uint32_t v = 0;
+    if (b.size() - at < sizeof v)
+      ok = false;
+    else
+      std::memcpy(&v, b.data() + at, sizeof v);
+    at += ok ? sizeof v : 0;
+    return v;
+  }
+  std::string_view get_str()
+  {
+    const uint32_t n = get_u32();
+    if (!ok || b.size() - at < n)
+    {
+      ok = false;
+      return {};
+    }
+    at += n;
+    return std::string_view(b).substr(at - n, n);
+  }
+};
+
+static inline bool read_full(int fd, char *p, size_t n)
+{
+  while (n > 0)
+  {
+    ssize_t m = ::read(fd, p, n);
+    if (m < 0 && errno == EINTR)
+      continue;
+    if (m <= 0)
+      return false;
+    p += m;
+    n -= size_t(m);
+  }
+  return true;
 }
 
-static inline shpp::Result exec_pipeline(const shpp::Pipeline &pl, std::ostream &out, std::ostream &err)
+// Sends w.b (its first 4 bytes are the length slot) with `fds` riding on the first byte
+static inline void send_request(int sock, Wire &w, const std::vector<int> &fds)
 {
-  if (pl.stages.empty())
-    throw std::runtime_error("empty pipeline");
+  const uint32_t len = uint32_t(w.b.size() - sizeof(uint32_t));
+  std::memcpy(w.b.data(), &len, sizeof len);
+  std::vector<char> ctl(CMSG_SPACE(sizeof(int) * fds.size()));
+  iovec iov{w.b.data(), w.b.size()};
+  msghdr mh{};
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctl.data();
+  mh.msg_controllen = socklen_t(ctl.size());
+  cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+  std::memcpy(CMSG_DATA(cm), fds.data(), sizeof(int) * fds.size());
 
-  const size_t N = pl.stages.size();
-  std::vector<pid_t> pids(N, -1);
+  ssize_t n;
+  do
+    n = ::sendmsg(sock, &mh, send_flags);
+  while (n < 0 && errno == EINTR);
+  if (n < 0)
+    throw std::system_error(errno, std::generic_category(), "sendmsg (spawn server)");
+  for (size_t off = size_t(n); off < w.b.size();)
+  {
+    ssize_t m = ::send(sock, w.b.data() + off, w.b.size() - off, send_flags);
+    if (m < 0 && errno == EINTR)
+      continue;
+    if (m < 0)
+      throw std::system_error(errno, std::generic_category(), "send (spawn server)");
+    off += size_t(m);
+  }
+}
+
+// Server side of send_request(); false on EOF (the parent is gone)
+static inline bool recv_request(int sock, Wire &w, std::vector<shpp::detail::Fd> &fds)
+{
+  uint32_t len = 0;
+  std::vector<char> ctl(CMSG_SPACE(sizeof(int) * max_server_fds));
+  iovec iov{&len, sizeof len};
+  msghdr mh{};
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctl.data();
+  mh.msg_controllen = socklen_t(ctl.size());
+#if defined(MSG_CMSG_CLOEXEC)
+  const int flags = MSG_CMSG_CLOEXEC;
+#else
+  const int flags = 0;
+#endif
+  ssize_t n;
+  do
+    n = ::recvmsg(sock, &mh, flags);
+  while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return false;
+  for (cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm))
+  {
+    if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+      continue;
+    const size_t k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < k; ++i)
+    {
+      int fd;
+      std::memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof fd);
+      set_cloexec(fd); // only the dup2'd copies may reach the stages
+      fds.emplace_back(fd);
+    }
+  }
+  if (size_t(n) < sizeof len && !read_full(sock, reinterpret_cast<char *>(&len) + n, sizeof len - size_t(n)))
+    return false;
+  w.b.resize(len);
+  w.at = 0;
+  return read_full(sock, w.b.data(), len);
+}
+
+static int server_sigchld_fd = -1; // self-pipe, server process only
+
+static void server_on_sigchld(int)
+{
+  const int e = errno;
+  const char c = 0;
+  (void)!::write(server_sigchld_fd, &c, 1);
+  errno = e;
+}
+
+// Launches one request's stages; replies {errno, pids...} and remembers who to tell about exits
+struct ServerJob
+{
+  shpp::detail::Fd reply;
+};
+using ServerKids = std::unordered_map<pid_t, std::pair<std::shared_ptr<ServerJob>, uint32_t>>;
+
+// One stage's exit on the reply socket; both ends are this same binary, so rusage goes as is
+struct ExitMsg
+{
+  int32_t stage;
+  int st;
+  rusage ru;
+};
+
+static void serve_request(Wire &w, std::vector<shpp::detail::Fd> &fds, ServerKids &kids)
+{
+  if (fds.empty())
+    return;
+  auto job = std::make_shared<ServerJob>();
+  job->reply = std::move(fds[0]);
+  size_t k = 1;
+
+  const uint32_t n = w.get_u32();
+  const bool own_group = w.get_u32() != 0;
+  if (n == 0 || n > max_server_fds)
+    return; // malformed: the parent sees the reply socket close
+  std::vector<StageIo> io(n);
+  std::vector<shpp::Cmd> cmds(n);
+  std::vector<std::string_view> exes(n), cwds(n);
+  for (uint32_t i = 0; i < n && w.ok; ++i)
+  {
+    const uint32_t mask = w.get_u32();
+    int *slots[3] = {&io[i].in, &io[i].out, &io[i].err};
+    for (int t = 0; t < 3; ++t)
+      if ((mask & (1u << t)) && k < fds.size())
+        *slots[t] = fds[k++].fd;
+      else if (mask & (8u << t))
+        *slots[t] = closed_fd;
+    exes[i] = w.get_str();
+    cwds[i] = w.get_str();
+    const uint32_t argc = w.get_u32();
+    for (uint32_t a = 0; a < argc && w.ok; ++a)
+      cmds[i].arg(w.get_str());
+  }
+  std::vector<std::string> vars(w.ok ? w.get_u32() : 0);
+  for (auto &v : vars)
+    v = w.get_str();
+  if (!w.ok)
+    return;
+  std::vector<char *> envp;
+  envp.reserve(vars.size() + 1);
+  for (auto &v : vars)
+    envp.push_back(v.data());
+  envp.push_back(nullptr);
+  std::vector<std::string> exe_z(exes.begin(), exes.end()), cwd_z(cwds.begin(), cwds.end()); // NUL-terminated
+
+  std::vector<int32_t> out(1 + n, -1);
+  out[0] = 0;
+  pid_t pgid = 0;
+  try
+  {
+    for (uint32_t i = 0; i < n; ++i)
+    {
+      if (!cwd_z[i].empty())
+        io[i].cwd = cwd_z[i].c_str();
+      if (own_group)
+        io[i].pgid = pgid;
+      io[i].default_sigpipe = true; // we ignore it, and ignored signals survive exec
+      const char *exe = exe_z[i].empty() ? nullptr : exe_z[i].c_str();
+      pid_t pid;
+#if SHPP_HAVE_POSIX_SPAWN
+      if (SHPP_HAVE_SPAWN_CHDIR || !io[i].cwd)
+        pid = spawn_posix(cmds[i], exe, envp.data(), io[i]);
+      else
+#endif
+        pid = spawn_fork(cmds[i], exe, envp.data(), io[i]);
+      out[1 + i] = pid;
+      if (pid > 0)
+        kids.emplace(pid, std::make_pair(job, i));
+      if (pid > 0 && pgid == 0)
+        pgid = pid;
+    }
+  }
+  catch (const std::system_error &e)
+  {
+    out[0] = e.code().value();
+  }
+  (void)::send(job->reply.fd, out.data(), out.size() * sizeof(int32_t), send_flags);
+}
+
+[[noreturn]] static void serve(int ctrl)
+{
+  // Fresh signal state: the parent's handlers and mask came along with fork()
+  sigset_t none;
+  sigemptyset(&none);
+  ::sigprocmask(SIG_SETMASK, &none, nullptr);
+  ::signal(SIGPIPE, SIG_IGN);
+  try
+  {
+    int sp[2];
+    make_pipe_cloexec(sp);
+    set_nonblock(sp[0]);
+    set_nonblock(sp[1]);
+    server_sigchld_fd = sp[1];
+    struct sigaction sa{};
+    sa.sa_handler = server_on_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    ::sigaction(SIGCHLD, &sa, nullptr);
 
-  // Detect real console sinks (avoid capture -> no tOut/tErr threads)
-  const bool to_console_out = (&out == &std::cout);
-  const bool to_console_err = (&err == &std::cerr);
+    ServerKids kids;
+    for (;;)
+    {
+      pollfd p[2] = {{ctrl, POLLIN, 0}, {sp[0], POLLIN, 0}};
+      if (::poll(p, 2, -1) < 0)
+        continue; // EINTR (SIGCHLD)
+      if (p[1].revents)
+      {
+        char drain[64];
+        while (::read(sp[0], drain, sizeof drain) > 0)
+          ;
+        ExitMsg msg{};
+        pid_t pid;
+        while ((pid = ::wait4(-1, &msg.st, WNOHANG, &msg.ru)) > 0)
+        {
+          auto it = kids.find(pid);
+          if (it == kids.end())
+            continue;
+          msg.stage = int32_t(it->second.second);
+          (void)::send(it->second.first->reply.fd, &msg, sizeof msg, send_flags);
+          kids.erase(it); // the last stage of a job closes its reply socket
+        }
+      }
+      if (p[0].revents)
+      {
+        Wire w;
+        std::vector<shpp::detail::Fd> fds;
+        if (!recv_request(ctrl, w, fds))
+          break; // the parent is gone
+        serve_request(w, fds, kids);
+      }
+    }
+  }
+  catch (...)
+  {
+  }
+  _exit(0);
+}
+
+// Threads in this process, from /proc/self/status (Linux); 0 where that can't be told
+static inline long thread_count()
+{
+#if defined(__linux__)
+  shpp::detail::Fd f(::open("/proc/self/status", O_RDONLY | O_CLOEXEC));
+  char buf[4096];
+  const ssize_t n = f.fd < 0 ? -1 : ::read(f.fd, buf, sizeof buf - 1);
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+  const char *t = std::strstr(buf, "\nThreads:");
+  return t ? std::strtol(t + 9, nullptr, 10) : 0;
+#else
+  return 0;
+#endif
+}
+
+struct SpawnServer
+{
+  std::mutex m;
+  shpp::detail::Fd ctrl;
+
+  static SpawnServer &get()
+  {
+    static SpawnServer *s = new SpawnServer; // never destroyed: the server exits once ctrl closes with us
+    return *s;
+  }
+
+  bool running()
+  {
+    std::lock_guard<std::mutex> lk(m);
+    return ctrl.fd >= 0;
+  }
+
+  // With m held. The child doesn't exec, so it must not inherit a lock (PathCache's, the
+  // allocator's) another thread held at fork: only start it while we have one thread.
+  void start()
+  {
+    if (ctrl.fd >= 0)
+      return;
+    if (thread_count() > 1)
+      throw std::runtime_error("shpp: start_spawn_server() must be called before any threads are started");
+    int sv[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+      throw std::system_error(errno, std::generic_category(), "socketpair");
+    set_cloexec(sv[0]);
+    set_cloexec(sv[1]);
+    pid_t pid = ::fork();
+    if (pid < 0)
+    {
+      const int e = errno;
+      ::close(sv[0]);
+      ::close(sv[1]);
+      throw std::system_error(e, std::generic_category(), "fork (spawn server)");
+    }
+    if (pid == 0)
+    {
+      // ---- Server ---- keeps stdio (for exec failure messages) and its socket only
+      const long lim = std::min(::sysconf(_SC_OPEN_MAX), 65536L);
+      for (int fd = 3; fd < lim; ++fd)
+        if (fd != sv[1])
+          ::close(fd);
+      serve(sv[1]);
+    }
+    ::close(sv[1]);
+    ctrl = shpp::detail::Fd(sv[0]);
+  }
+};
+
+// Parent side: has the server launch every stage; fills pids and returns the job's reply socket
+static inline shpp::detail::Fd spawn_remote(const shpp::Pipeline &pl,
+                                            const std::vector<std::string> &exes,
+                                            const std::vector<StageIo> &io,
+                                            bool own_group,
+                                            std::vector<pid_t> &pids)
+{
+  const size_t N = pl.stages.size();
+  if (1 + 3 * N > max_server_fds)
+    throw std::runtime_error("pipeline too long for the spawn server");
+  int js[2];
+  if (::socketpair(AF_UNIX, SOCK_SEQPACKET, 0, js) != 0)
+    throw std::system_error(errno, std::generic_category(), "socketpair");
+  set_cloexec(js[0]);
+  set_cloexec(js[1]);
+  shpp::detail::Fd mine(js[0]), theirs(js[1]);
+
+  Wire w;
+  w.put(uint32_t(0)); // length slot
+  w.put(uint32_t(N));
+  w.put(uint32_t(own_group));
+  // The server's cwd is where it started; stages without an absolute .cwd() get ours
+  char *here_p = ::getcwd(nullptr, 0);
+  if (!here_p)
+    throw std::system_error(errno, std::generic_category(), "getcwd");
+  const std::string here(here_p);
+  ::free(here_p);
+  std::string cwd;
+  std::vector<int> fds{theirs.fd};
+  for (size_t i = 0; i < N; ++i)
+  {
+    const int std_fds[3] = {io[i].in, io[i].out, io[i].err};
+    uint32_t mask = 0;
+    for (int t = 0; t < 3; ++t)
+      if (std_fds[t] >= 0)
+      {
+        mask |= 1u << t;
+        fds.push_back(std_fds[t]);
+      }
+      else if (std_fds[t] == closed_fd)
+        mask |= 8u << t; // just close it
+    w.put(mask);
+    w.put(exes[i]);
+    if (io[i].cwd && io[i].cwd[0] == '/')
+      cwd = io[i].cwd;
+    else
+      cwd.assign(here).append(io[i].cwd ? "/" : "").append(io[i].cwd ? io[i].cwd : "");
+    w.put(cwd);
+    const shpp::Cmd &c = pl.stages[i];
+    w.put(uint32_t(c.size()));
+    for (size_t a = 0; a < c.size(); ++a)
+      w.put(c[a]);
+  }
+  // The server's environ is a snapshot from when it started; always send the live one
+  if (pl.env)
+  {
+    w.put(uint32_t(pl.env->vars().size()));
+    for (auto &v : pl.env->vars())
+      w.put(v);
+  }
+  else
+  {
+    uint32_t n = 0;
+    for (char **p = environ; p && *p; ++p)
+      ++n;
+    w.put(n);
+    for (char **p = environ; p && *p; ++p)
+      w.put(std::string_view(*p));
+  }
+
+  {
+    SpawnServer &srv = SpawnServer::get();
+    std::lock_guard<std::mutex> lk(srv.m);
+    if (srv.ctrl.fd < 0)
+      throw std::runtime_error("shpp: the spawn server isn't running; call start_spawn_server() first");
+    send_request(srv.ctrl.fd, w, fds);
+  }
+  theirs.close();
+
+  std::vector<int32_t> reply(1 + N);
+  ssize_t n;
+  do
+    n = ::recv(mine.fd, reply.data(), reply.size() * sizeof(int32_t), 0);
+  while (n < 0 && errno == EINTR);
+  if (n != ssize_t(reply.size() * sizeof(int32_t)))
+    throw std::system_error(n < 0 ? errno : ECONNRESET, std::generic_category(), "spawn server");
+  if (reply[0] != 0)
+    throw std::system_error(reply[0], std::generic_category(), "spawn server");
+  for (size_t i = 0; i < N; ++i)
+    pids[i] = reply[1 + i];
+  return mine;
+}
+
+// Where one of the final stage's streams goes. Either the child writes straight onto
+// `direct` (-1 = inherits ours; the real console is never pumped), or shpp pumps a pipe
+// into `os` / `str`. Files are opened here like the shell's `>`/`>>`.
+struct Target
+{
+  int direct = -1;
+  std::ostream *os = nullptr;
+  const shpp::OutString *str = nullptr;
+  const shpp::OutChunk *chunk = nullptr;
+  const shpp::OutLine *line = nullptr;
+  shpp::detail::Fd file; // opened redirect, owned until the launch is done
+  bool write_direct = false; // pump into `direct` anyway: filters sit in between
+
+  bool pumped() const { return os || str || chunk || line || write_direct; }
+};
+
+static inline Target route(const shpp::Output &o, std::ostream &console)
+{
+  Target t;
+  if (auto f = std::get_if<shpp::OutFd>(&o.to))
+    t.direct = f->fd;
+  else if (auto fl = std::get_if<shpp::OutFile>(&o.to))
+  {
+    t.file = open_redirect(fl->path, O_WRONLY | O_CREAT | (fl->append ? O_APPEND : O_TRUNC));
+    t.direct = t.file.fd;
+  }
+  else if (auto st = std::get_if<shpp::OutString>(&o.to))
+    t.str = st;
+  else if (auto ck = std::get_if<shpp::OutChunk>(&o.to))
+    t.chunk = ck;
+  else if (auto ln = std::get_if<shpp::OutLine>(&o.to))
+    t.line = ln;
+  else if (std::holds_alternative<shpp::OutNull>(o.to))
+    t.direct = dev_null();
+  else if (auto os = std::get<std::ostream *>(o.to); os != &console)
+    t.os = os;
+  return t;
+}
+
+// Feeds the first stage's stdin from an Input through the (non-blocking) pipe write end
+struct Feed
+{
+  shpp::detail::Fd fd;
+  const shpp::Input *src = nullptr;
+  size_t off = 0;          // InString/InView: bytes already written
+  std::vector<char> chunk; // InStream: bytes read but not yet written
+  size_t head = 0;
+  size_t chunk_size = 64 * 1024;
+  bool splice = true; // vmsplice() in-memory payloads until the kernel refuses
+  // Writes as much as the pipe takes; closes fd (EOF to child) when done or on error
+  void step()
+  {
+    for (;;)
+    {
+      const char *p = nullptr;
+      size_t n = 0;
+      bool in_memory = true; // stays put until the job is done, so it may be vmspliced
+      if (auto s = std::get_if<shpp::InString>(src))
+      {
+        p = s->data.data() + off;
+        n = s->data.size() - off;
+      }
+      else if (auto v = std::get_if<shpp::InView>(src))
+      {
+        p = v->data + off;
+        n = v->size - off;
+      }
+      else if (auto st = std::get_if<shpp::InStream>(src))
+      {
+        if (head == chunk.size())
+        {
+          size_t got = 0;
+          chunk.resize(chunk_size);
+          if (st->is && st->is->good())
+          {
+            st->is->read(chunk.data(), std::streamsize(chunk.size()));
+            got = size_t(st->is->gcount());
+          }
+          chunk.resize(got);
+          head = 0;
+        }
+        p = chunk.data() + head;
+        n = chunk.size() - head;
+        in_memory = false; // chunk is refilled as soon as it's written
+      }
+      if (n == 0)
+        break; // all written
+      ssize_t m;
+#if defined(__linux__) && defined(SPLICE_F_NONBLOCK)
+      // Large in-memory payloads: map the pages into the pipe instead of copying them in
+      if (in_memory && splice && n >= 64 * 1024)
+      {
+        iovec iov{const_cast<char *>(p), n};
+        m = ::vmsplice(fd.fd, &iov, 1, SPLICE_F_NONBLOCK);
+        if (m < 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+          splice = false;
+          continue;
+        }
+      }
+      else
+#endif
+        m = ::write(fd.fd, p, n);
+      if (m > 0)
+      {
+        off += size_t(m);
+        head += size_t(m);
+        continue;
+      }
+      if (m < 0 && errno == EINTR)
+        continue;
+      if (m < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return; // pipe full; wait for POLLOUT
+      break;    // error/EPIPE
+    }
+    fd.close(); // EOF to child
+  }
+};
+
+// ===== fixed-string search
+// Offset of needle in hay, or npos. Vector kernels test block-wide for the needle's first
+// and last byte at once (SSE2 is x86-64's baseline, AVX2 is picked at runtime, NEON is
+// aarch64's) and memcmp only the candidates both agree on; what's left of hay past the
+// last full block goes to the scalar search. Newlines are found with memchr(), which
+// libcs already vectorize and dispatch.
+static inline size_t find_scalar(const char *hay, size_t n, const char *needle, size_t m)
+{
+  return std::string_view(hay, n).find(std::string_view(needle, m));
+}
+
+// The rest of hay from i on, past the last full block
+static inline size_t find_tail(const char *hay, size_t n, size_t i, const char *needle, size_t m)
+{
+  const size_t r = find_scalar(hay + i, n - i, needle, m);
+  return r == std::string_view::npos ? r : i + r;
+}
+
+#if SHPP_HAVE_SIMD && defined(__x86_64__)
+// Candidates at hay[i + bit] for each bit set in mask: confirm with memcmp
+static inline size_t confirm(const char *hay, size_t i, uint32_t mask, const char *needle, size_t m)
+{
+  for (; mask; mask &= mask - 1)
+  {
+    const size_t at = i + size_t(__builtin_ctz(mask));
+    if (std::memcmp(hay + at + 1, needle + 1, m - 2) == 0)
+      return at;
+  }
+  return std::string_view::npos;
+}
+
+static size_t find_sse2(const char *hay, size_t n, const char *needle, size_t m)
+{
+  const __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 16 <= n; i += 16)
+  {
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hay + i));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hay + i + m - 1));
+    const __m128i both = _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last));
+    if (size_t at = confirm(hay, i, uint32_t(_mm_movemask_epi8(both)), needle, m); at != std::string_view::npos)
+      return at;
+  }
+  return find_tail(hay, n, i, needle, m);
+}
+
+__attribute__((target("avx2"))) static size_t find_avx2(const char *hay, size_t n, const char *needle, size_t m)
+{
+  const __m256i first = _mm256_set1_epi8(needle[0]), last = _mm256_set1_epi8(needle[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 32 <= n; i += 32)
+  {
+    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(hay + i));
+    const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(hay + i + m - 1));
+    const __m256i both = _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last));
+    if (size_t at = confirm(hay, i, uint32_t(_mm256_movemask_epi8(both)), needle, m); at != std::string_view::npos)
+      return at;
+  }
+  return find_tail(hay, n, i, needle, m);
+}
+#elif SHPP_HAVE_SIMD && defined(__aarch64__)
+static size_t find_neon(const char *hay, size_t n, const char *needle, size_t m)
+{
+  const uint8x16_t first = vdupq_n_u8(uint8_t(needle[0])), last = vdupq_n_u8(uint8_t(needle[m - 1]));
+  size_t i = 0;
+  for (; i + m - 1 + 16 <= n; i += 16)
+  {
+    const uint8x16_t a = vld1q_u8(reinterpret_cast<const uint8_t *>(hay + i));
+    const uint8x16_t b = vld1q_u8(reinterpret_cast<const uint8_t *>(hay + i + m - 1));
+    const uint8x16_t both = vandq_u8(vceqq_u8(a, first), vceqq_u8(b, last));
+    // One nibble per byte: NEON has no movemask
+    uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpret_u16_u8(both), 4)), 0);
+    while (mask)
+    {
+      const size_t at = i + size_t(__builtin_ctzll(mask) >> 2);
+      if (std::memcmp(hay + at + 1, needle + 1, m - 2) == 0)
+        return at;
+      mask &= ~(uint64_t(0xF) << ((at - i) * 4));
+    }
+  }
+  return find_tail(hay, n, i, needle, m);
+}
+#endif
+
+static inline size_t find_fixed(std::string_view hay, std::string_view needle)
+{
+  const size_t m = needle.size();
+  if (m < 2 || hay.size() < m)
+    return hay.find(needle); // memchr() for one byte
+  using Kernel = size_t (*)(const char *, size_t, const char *, size_t);
+#if SHPP_HAVE_SIMD && defined(__x86_64__)
+  static const Kernel kernel = __builtin_cpu_supports("avx2") ? find_avx2 : find_sse2;
+#elif SHPP_HAVE_SIMD && defined(__aarch64__)
+  static const Kernel kernel = find_neon;
+#else
+  static const Kernel kernel = find_scalar;
+#endif
+  return kernel(hay.data(), hay.size(), needle.data(), m);
+}
+
+// Splits [p, p + n) into lines for on(line), straight out of the read buffer unless a line
+// spans reads; only that partial line is copied (into carry). Lines longer than max are
+// handed over in max-byte pieces.
+template <class On>
+static void split_lines(std::string &carry, size_t max, const char *p, size_t n, On &&on)
+{
+  max = std::max<size_t>(max, 1);
+  while (n > 0)
+  {
+    const char *nl = static_cast<const char *>(std::memchr(p, '\n', n));
+    const size_t len = nl ? size_t(nl - p) : n;
+    if (carry.size() + len > max)
+    {
+      // Too long: hand over a piece of exactly max bytes, keep going with the rest
+      const size_t take = max - carry.size();
+      if (carry.empty())
+        on(std::string_view(p, take));
+      else
+      {
+        carry.append(p, take);
+        on(std::string_view(carry));
+        carry.clear();
+      }
+      p += take;
+      n -= take;
+      continue;
+    }
+    if (!nl)
+    {
+      carry.append(p, len);
+      return;
+    }
+    if (carry.empty())
+      on(std::string_view(p, len));
+    else
+    {
+      carry.append(p, len);
+      on(std::string_view(carry));
+      carry.clear();
+    }
+    p += len + 1;
+    n -= len + 1;
+  }
+}
+
+static inline void write_all(int fd, const char *p, size_t n)
+{
+  while (n > 0)
+  {
+    ssize_t m = ::write(fd, p, n);
+    if (m < 0 && errno == EINTR)
+      continue;
+    if (m < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      pollfd pf{fd, POLLOUT, 0};
+      (void)::poll(&pf, 1, -1);
+      continue;
+    }
+    if (m < 0)
+      throw std::system_error(errno, std::generic_category(), "write");
+    p += m;
+    n -= size_t(m);
+  }
+}
+
+// Pipeline::filters on the stdout channel. Each line runs through them in order; what
+// the last one emits is staged (with its '\n' back) and goes to the sink once per read.
+struct FilterChain
+{
+  std::vector<shpp::Filter> &filters;
+  const shpp::OutLine *line; // sink that takes lines as they are, or nullptr
+  std::vector<shpp::Emit> emits; // emits[i] is what filters[i] calls; feeds filters[i + 1]
+  std::string staged;
+  std::string carry;
+  size_t dead = 0; // filters [0, dead) take no more input (one of them said so)
+
+  FilterChain(std::vector<shpp::Filter> &f, const shpp::OutLine *l) : filters(f), line(l)
+  {
+    emits.reserve(filters.size());
+    for (size_t i = 0; i + 1 < filters.size(); ++i)
+      emits.emplace_back([this, i](std::string_view s) { feed(i + 1, s); });
+    emits.emplace_back([this](std::string_view s) {
+      if (line)
+        line->fn(s);
+      else
+      {
+        staged.append(s);
+        staged.push_back('\n');
+      }
+    });
+  }
+
+  void feed(size_t i, std::string_view s)
+  {
+    if (i >= dead && !filters[i].line(s, emits[i]))
+      dead = std::max(dead, i + 1);
+  }
+
+  void feed(const char *p, size_t n)
+  {
+    split_lines(carry, 1 << 20, p, n, [&](std::string_view s) { feed(0, s); });
+  }
+
+  void finish()
+  {
+    if (!carry.empty())
+    {
+      std::string last = std::move(carry);
+      carry.clear();
+      feed(0, last); // unterminated last line
+    }
+    for (size_t i = 0; i < filters.size(); ++i)
+      if (filters[i].end)
+        filters[i].end(emits[i]);
+  }
+};
+
+// One captured stream: pipe read end -> sink
+struct Channel
+{
+  shpp::detail::Fd fd;
+  std::ostream *os;               // either a stream ...
+  const shpp::OutString *str;     // ... or a string we read() straight into
+  const shpp::OutChunk *chunk;    // ... or callbacks fed views of buf
+  const shpp::OutLine *line;
+  int direct = -1;                // ... or an fd we write() to (filtered to_fd/to_file output)
+  shpp::detail::Fd file{};        // to_file sink, opened for `direct`
+  std::unique_ptr<FilterChain> chain{}; // in-process stages between the pipe and the sink
+  std::string carry{};            // OutLine: the start of a line the last read() cut off
+  size_t taken = 0;               // bytes appended to *str so far
+  size_t bytes = 0;               // read from the pipe (Result::stats)
+  bool truncated = false;         // str->max_bytes was hit; the rest is drained and dropped
+
+  // Grows *str by up to n bytes of read() output, skipping the zero-fill where the library can
+  ssize_t read_into_string(size_t n)
+  {
+    std::string &s = *str->s;
+    const size_t old = s.size();
+    if (s.capacity() - old < n)
+      s.reserve(std::max(old + n, 2 * s.capacity()));
+    ssize_t got = -1;
+#if defined(__cpp_lib_string_resize_and_overwrite)
+    s.resize_and_overwrite(old + n, [&](char *p, size_t) {
+      got = ::read(fd.fd, p + old, n);
+      return old + size_t(std::max<ssize_t>(got, 0));
+    });
+#else
+    s.resize(old + n);
+    got = ::read(fd.fd, s.data() + old, n);
+    s.resize(old + size_t(std::max<ssize_t>(got, 0)));
+#endif
+    if (got > 0)
+      taken += size_t(got);
+    return got;
+  }
+
+  // Bytes for the sink that didn't come straight from read() into *str
+  void put(const char *p, size_t n, shpp::Flush flush)
+  {
+    if (n == 0)
+      return;
+    if (str)
+    {
+      const size_t room = str->max_bytes - taken;
+      str->s->append(p, std::min(n, room));
+      taken += std::min(n, room);
+      truncated = truncated || n > room;
+    }
+    else if (chunk)
+      chunk->fn(std::string_view(p, n));
+    else if (line)
+      split_lines(carry, line->max_line, p, n, line->fn);
+    else if (direct >= 0)
+      write_all(direct, p, n);
+    else
+    {
+      os->write(p, std::streamsize(n));
+      if (flush == shpp::Flush::Chunk || (flush == shpp::Flush::Line && std::memchr(p, '\n', n)))
+        os->flush();
+    }
+  }
+
+  void put_staged(shpp::Flush flush)
+  {
+    put(chain->staged.data(), chain->staged.size(), flush);
+    chain->staged.clear();
+  }
+
+  // One read per wakeup keeps the channels fair; closes fd on EOF or error
+  void step(char *buf, size_t cap, shpp::Flush flush)
+  {
+    ssize_t n;
+    if (str && !chain && taken < str->max_bytes)
+      n = read_into_string(std::min(cap, str->max_bytes - taken));
+    else
+    {
+      n = ::read(fd.fd, buf, cap);
+      if (n > 0 && chain)
+      {
+        chain->feed(buf, size_t(n));
+        if (chain->dead > 0)
+          n = 0; // a filter is done (head): close the pipe early, upstream gets SIGPIPE
+        else
+          put_staged(flush);
+      }
+      else if (n > 0 && str)
+        truncated = true;
+      else if (n > 0)
+        put(buf, size_t(n), flush);
+    }
+    if (n > 0)
+      bytes += size_t(n);
+    if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+      fd.close(); // EOF or read error
+      if (chain)
+      {
+        chain->finish();
+        put_staged(flush);
+      }
+      if (os && flush != shpp::Flush::Never)
+        os->flush();
+      if (line && !carry.empty())
+      {
+        std::string last = std::move(carry);
+        carry.clear();
+        line->fn(last); // unterminated last line
+      }
+    }
+  }
+};
+
+// Applies Capture::pipe_size (Linux); returns the pipe's capacity, 0 if unknown
+static inline size_t tune_pipe(int fd, size_t pipe_size)
+{
+#if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+  if (pipe_size > 0)
+    (void)::fcntl(fd, F_SETPIPE_SZ, int(std::min<size_t>(pipe_size, INT_MAX))); // above pipe-max-size: keep default
+  const int cap = ::fcntl(fd, F_GETPIPE_SZ);
+  return cap > 0 ? size_t(cap) : 0;
+#else
+  (void)fd;
+  (void)pipe_size;
+  return 0;
+#endif
+}
+
+#if SHPP_HAVE_PIDFD
+// Returns -1 when the kernel has no pidfd_open (pre-5.3); callers fall back to plain waitpid
+static inline int open_pidfd(pid_t pid)
+{
+  return int(::syscall(SYS_pidfd_open, pid, 0));
+}
+
+#ifndef P_PIDFD
+#define P_PIDFD 3 // <linux/wait.h>; older libc headers lack it
+#endif
+
+// waitid()'s siginfo back to the waitpid() status encoding the rest of shpp uses
+static inline int wait_status(const siginfo_t &si)
+{
+  switch (si.si_code)
+  {
+  case CLD_EXITED: return exited_with(si.si_status);
+  case CLD_KILLED: return si.si_status & 0x7f;
+  case CLD_DUMPED: return (si.si_status & 0x7f) | 0x80;
+  default: return exited_with(127);
+  }
+}
+#endif
+
+// ===== metrics hook (set_metrics_hook); copied out under the lock, called outside it
+struct Metrics
+{
+  std::mutex m;
+  std::shared_ptr<const shpp::MetricsHook> hook;
+  std::atomic<bool> set{false}; // skips the lock for the common no-hook case
+
+  static Metrics &get()
+  {
+    static Metrics g;
+    return g;
+  }
+
+  std::shared_ptr<const shpp::MetricsHook> current()
+  {
+    if (!set.load(std::memory_order_acquire))
+      return nullptr;
+    std::lock_guard<std::mutex> lk(m);
+    return hook;
+  }
+};
+
+// Everything a started pipeline needs until its last stage is reaped
+struct shpp::detail::JobState
+{
+  Pipeline pl; // owns the stdin payload the feed points into
+  Output out;
+  Output err;
+  std::vector<pid_t> pids;
+  std::vector<int> statuses;
+  std::vector<char> reaped;
+  size_t live = 0;        // stages not reaped yet
+  size_t spawned = 0;     // stages launch() got to; a launch that threw leaves the rest never started
+  std::vector<Fd> pidfds; // readable once the stage exits (Linux); empty elsewhere
+  Fd remote;              // Spawn::Server: the server's reply socket, one message per stage exit
+  // Timeout / cancellation: the stages' own process group and what to send it next
+  pid_t pgid = 0; // 0 = they share ours; nothing is ever signalled
+  enum class Kill : unsigned char
+  {
+    None,
+    Termed,  // SIGTERM sent; SIGKILL at `deadline`
+    Killed,
+  } kill = Kill::None;
+  std::chrono::steady_clock::time_point deadline; // of the timeout, then of the grace period
+  bool timed_out = false;
+  bool cancelled = false;
+  int failed_stage = -1; // pipefail: the first stage that exited non-zero
+  Fd timer; // timerfd behind Job::fd() for `deadline` (Linux)
+  std::chrono::steady_clock::time_point started;
+  std::vector<std::chrono::steady_clock::time_point> exit_times;
+  std::vector<std::chrono::steady_clock::time_point> spawned_at;
+  std::vector<StageStats> usage; // filled in as stages are spawned and reaped
+  std::chrono::nanoseconds launch_time{0};
+  bool waitid_pidfd = true; // cleared if the kernel rejects waitid(P_PIDFD)
+  Feed feed;
+  std::vector<Channel> chans; // the stdout sink's first, if stdout_pumped
+  bool stdout_pumped = false;
+  std::vector<std::string> stage_err;  // Stderr::Capture output, by stage
+  std::vector<OutString> err_sinks;    // their channels' sinks
+  Fd ep; // epoll set behind Job::fd(), created on first use
+  Fd done_ev; // eventfd in `ep` once finished, so a poller wakes for try_wait()
+  std::vector<char> buf;    // read buffer shared by the channels (Capture::buffer)
+  std::optional<Result> res;
+  Result spare;             // a recycled Result whose vectors res takes over (Runner)
+  std::vector<pollfd> pfds; // scratch for step()
+  // Scratch for launch(), kept so a reused JobState (Runner) launches without allocating
+  std::vector<std::pair<Fd, Fd>> pipes; // (read, write) between stages
+  std::vector<StageIo> io;
+  std::vector<std::string> exes;
+  std::vector<char *> envp;
+  std::vector<Fd> errCapW;
+  std::vector<std::pair<size_t, Fd>> errCapR; // (stage, read end)
+
+  JobState(Pipeline p, Output o, Output e) : pl(std::move(p)), out(std::move(o)), err(std::move(e)) {}
+
+  void reset(Pipeline p, Output o, Output e);
+
+  void launch();
+  void step(int timeout_ms);
+  bool reap(size_t i, int flags);
+  bool recv_exit(bool block);
+  void exited(size_t i, int st, const rusage &ru);
+  void reap_any();
+  void abandon();
+  bool has_deadline() const { return pgid > 0 && ((kill == Kill::None && pl.timeout.count() > 0) || kill == Kill::Termed); }
+  bool watch_cancel() const { return pgid > 0 && kill == Kill::None && pl.cancel; }
+  int until_deadline(int timeout_ms) const;
+  void police();
+  void arm_timer();
+  bool pumping() const
+  {
+    if (feed.fd.fd >= 0)
+      return true;
+    for (auto &ch : chans)
+      if (ch.fd.fd >= 0)
+        return true;
+    return false;
+  }
+  bool finished() const { return live == 0 && !pumping(); }
+  // A filter stopped reading early (head): SIGPIPE deaths upstream are expected, not failures
+  bool cut_short(int st) const
+  {
+    if (!WIFSIGNALED(st) || WTERMSIG(st) != SIGPIPE)
+      return false;
+    for (auto &ch : chans)
+      if (ch.chain && ch.chain->dead > 0)
+        return true;
+    return false;
+  }
+  const Result &result();
+};
+
+void shpp::detail::JobState::launch()
+{
+  if (pl.stages.empty())
+    throw std::runtime_error("empty pipeline");
+
+  const size_t N = pl.stages.size();
+  spawned = 0;
+  pids.assign(N, -1);
+  statuses.assign(N, 0);
+  reaped.assign(N, 0);
+  exit_times.assign(N, {});
+  spawned_at.assign(N, {});
+  usage.assign(N, {});
+  started = std::chrono::steady_clock::now();
+
+  // Where the final stage writes: straight onto an fd / the console, or a pipe we pump into a stream
+  Target to_out = route(out, std::cout);
+  Target to_err = route(err, std::cerr);
+  if (!pl.filters.empty() && !to_out.pumped())
+  {
+    if (to_out.direct < 0)
+      to_out.os = &std::cout; // console: the filters' output goes out through std::cout
+    else
+      to_out.write_direct = true;
+  }
+
+  // ===== stdin source? fds/files are handed to the child as is; InString/InView/InStream are fed through a pipe
+  Fd in_file;
+  int in_fd = -1;
+  if (auto f = std::get_if<InFd>(&pl.stdin_src))
+    in_fd = f->fd;
+  else if (auto fl = std::get_if<InFile>(&pl.stdin_src))
+  {
+    in_file = open_redirect(fl->path, O_RDONLY); // `< path`
+    in_fd = in_file.fd;
+  }
+  else if (std::holds_alternative<InNull>(pl.stdin_src))
+    in_fd = dev_null();
+  else if (std::holds_alternative<InClosed>(pl.stdin_src))
+    in_fd = closed_fd;
+  const bool have_in = std::holds_alternative<InString>(pl.stdin_src) || std::holds_alternative<InView>(pl.stdin_src) ||
+                       std::holds_alternative<InStream>(pl.stdin_src);
+  Fd inR, inW;
+  if (have_in)
+  {
+    int fds[2];
+    make_pipe_cloexec(fds);
+    inR = Fd(fds[0]);
+    inW = Fd(fds[1]);
+  }
+
+  // ===== pipes between stages (stdout chaining)
+  pipes.clear();
+  for (size_t i = 0; i + 1 < N; ++i)
+  {
+    int fds[2];
+    make_pipe_cloexec(fds);
+    pipes.emplace_back(Fd(fds[0]), Fd(fds[1]));
+  }
+
+  // ===== capture pipes ONLY if going to a stream
+  Fd capOutR, capOutW, capErrR, capErrW;
+  if (to_out.pumped())
+  {
+    int fds[2];
+    make_pipe_cloexec(fds);
+    capOutR = Fd(fds[0]);
+    capOutW = Fd(fds[1]);
+  }
+  if (to_err.pumped())
+  {
+    int fds[2];
+    make_pipe_cloexec(fds);
+    capErrR = Fd(fds[0]);
+    capErrW = Fd(fds[1]);
+  }
+
+  // ===== plan each stage's stdio (-1 keeps the parent's fd)
+  io.assign(N, {});
+  for (size_t i = 0; i < N; ++i)
+  {
+    if (i == 0)
+      io[i].in = have_in ? inR.fd : in_fd; // -1: inherit parent's stdin
+    else
+      io[i].in = pipes[i - 1].first.fd;
+
+    if (i + 1 < N)
+      io[i].out = pipes[i].second.fd;
+    else
+      io[i].out = to_out.pumped() ? capOutW.fd : to_out.direct; // console: inherit parent's stdout directly
+
+    // Non-final stages keep default stderr -> parent's stderr
+    if (i + 1 == N)
+      io[i].err = to_err.pumped() ? capErrW.fd : to_err.direct;
+
+    if (!pl.cwd.empty())
+      io[i].cwd = pl.cwd.c_str();
+  }
+
+  // ===== per-stage stderr policies: 2>&1, 2>/dev/null, or a pipe of its own
+  errCapW.clear();
+  errCapR.clear();
+  stage_err.assign(N, {});
+  for (size_t i = 0; i < std::min(N, pl.stage_err.size()); ++i)
+  {
+    switch (pl.stage_err[i])
+    {
+    case Stderr::Inherit:
+      break;
+    case Stderr::Merge:
+      io[i].err = io[i].out >= 0 ? io[i].out : STDOUT_FILENO;
+      break;
+    case Stderr::Null:
+      io[i].err = dev_null();
+      break;
+    case Stderr::Capture:
+    {
+      int fds[2];
+      make_pipe_cloexec(fds);
+      errCapR.emplace_back(i, Fd(fds[0]));
+      errCapW.emplace_back(fds[1]);
+      io[i].err = fds[1];
+      break;
+    }
+    }
+  }
+
+  // ===== argv tables are ready-made in each Cmd; only Expand::AtRun ones need resolving
+  for (auto &c : pl.stages)
+    if (!c.words.empty())
+      c = c.expanded(); // against today's environment
+
+  // ===== resolve each program once (cached across launches) and build the envp table
+  exes.resize(N);
+  for (size_t i = 0; i < N; ++i)
+    PathCache::get().lookup(pl.stages[i].prog(), exes[i]);
+  envp.clear();
+  if (pl.env)
+  {
+    for (auto &v : pl.env->vars())
+      envp.push_back(const_cast<char *>(v.c_str()));
+    envp.push_back(nullptr);
+  }
+
+  // ===== launch stages
+  Spawn backend = resolve_spawn(pl.spawn);
+  if (backend == Spawn::Server && !SpawnServer::get().running())
+    backend = resolve_spawn(Spawn::Auto); // never forked lazily: we may have threads by now
+  if (!SHPP_HAVE_SPAWN_CHDIR && !pl.cwd.empty() && backend == Spawn::PosixSpawn)
+    backend = Spawn::Fork; // posix_spawn can't chdir here
+  const bool own_group = pl.timeout.count() > 0 || pl.cancel || pl.pipefail;
+  if (backend == Spawn::Server)
+  {
+    const auto t0 = std::chrono::steady_clock::now();
+    remote = spawn_remote(pl, exes, io, own_group, pids);
+    const auto t1 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < N; ++i)
+    {
+      spawned_at[i] = t1;
+      usage[i].spawn = t1 - t0; // one round trip for all of them
+    }
+    for (pid_t p : pids)
+      if (p > 0 && pgid == 0)
+        pgid = p; // the server's rule too: led by the first stage that started
+    live = spawned = N;
+    pipes.clear(); // the server holds the stages' copies now
+    for (size_t i = 0; i < N; ++i)
+      if (pids[i] < 0)
+        reap(i, WNOHANG); // couldn't be exec'd: no exit message will come
+    if (live == 0)
+      remote.close();
+  }
+  try
+  {
+    for (size_t i = 0; i < N && backend != Spawn::Server; ++i)
+    {
+      const Cmd &c = pl.stages[i];
+      const char *exe = exes[i].empty() ? nullptr : exes[i].c_str();
+      char *const *env_block = pl.env ? envp.data() : nullptr;
+      if (own_group)
+        io[i].pgid = pgid; // 0 for the first one: it leads the new group
+      const auto t0 = std::chrono::steady_clock::now();
+#if SHPP_HAVE_POSIX_SPAWN
+      if (backend == Spawn::PosixSpawn)
+        pids[i] = spawn_posix(c, exe, env_block, io[i]);
+      else
+#endif
+        pids[i] = spawn_fork(c, exe, env_block, io[i]);
+      spawned_at[i] = std::chrono::steady_clock::now();
+      usage[i].spawn = spawned_at[i] - t0;
+      ++live;
+      ++spawned;
+      if (own_group && pgid == 0 && pids[i] > 0)
+        pgid = pids[i];
+
+      // ---- Parent ----
+      if (i > 0)
+        pipes[i - 1].first.close(); // parent doesn't read from previous
+      if (i + 1 < N)
+        pipes[i].second.close(); // parent doesn't write to next
+    }
+  }
+  catch (...)
+  {
+    abandon(); // a later stage couldn't be spawned (EAGAIN, EMFILE, ...): leave nothing behind
+    throw;
+  }
+
+#if SHPP_HAVE_PIDFD
+  if (backend != Spawn::Server) // not our children: their exits come over `remote`
+    pidfds.resize(N);
+  for (size_t i = 0; i < pidfds.size(); ++i)
+  {
+    if (pids[i] >= 0)
+      pidfds[i] = Fd(open_pidfd(pids[i]));
+    if (pids[i] >= 0 && pidfds[i].fd < 0)
+    {
+      pidfds.clear(); // no pidfd support: fall back to waitpid
+      break;
+    }
+  }
+#endif
+  for (size_t i = 0; i < N && backend != Spawn::Server; ++i)
+    if (pids[i] < 0)
+      exited(i, exited_with(127), {}); // couldn't be exec'd: done now, nothing would wake us for it
+
+  // Parent: close capture write ends (children inherited dup'd ones)
+  capOutW.close();
+  capErrW.close();
+  errCapW.clear();
+
+  deadline = std::chrono::steady_clock::now() + pl.timeout;
+  police(); // a token that fired before we started
+
+  // ===== pump endpoints, driven by step(): stdin feed + stdout/stderr capture
+  if (have_in)
+  {
+    inR.close(); // parent never reads from inR
+    feed.fd = std::move(inW);
+    feed.src = &pl.stdin_src;
+    set_nonblock(feed.fd.fd);
+  }
+  chans.reserve(2 + errCapR.size());
+  stdout_pumped = to_out.pumped();
+  if (to_out.pumped())
+  {
+    chans.push_back(Channel{std::move(capOutR), to_out.os, to_out.str, to_out.chunk, to_out.line});
+    Channel &ch = chans.back();
+    if (to_out.write_direct)
+    {
+      ch.direct = to_out.direct;
+      ch.file = std::move(to_out.file);
+    }
+    if (!pl.filters.empty())
+      ch.chain = std::make_unique<FilterChain>(pl.filters, ch.line);
+  }
+  if (to_err.pumped())
+    chans.push_back(Channel{std::move(capErrR), to_err.os, to_err.str, to_err.chunk, to_err.line});
+  err_sinks.reserve(errCapR.size()); // chans point into it
+  for (auto &[i, r] : errCapR)
+  {
+    err_sinks.push_back(OutString{&stage_err[i], std::string::npos, 0});
+    chans.push_back(Channel{std::move(r), nullptr, &err_sinks.back(), nullptr, nullptr});
+  }
+  size_t cap = 0;
+  for (auto &ch : chans)
+  {
+    set_nonblock(ch.fd.fd);
+    cap = std::max(cap, tune_pipe(ch.fd.fd, pl.capture.pipe_size));
+  }
+  if (feed.fd.fd >= 0)
+    feed.chunk_size = std::max(pl.capture.buffer ? pl.capture.buffer : feed.chunk_size,
+                               tune_pipe(feed.fd.fd, pl.capture.pipe_size));
+  for (auto &ch : chans)
+    if (ch.str && ch.str->reserve)
+      ch.str->s->reserve(ch.str->s->size() + ch.str->reserve);
+  if (!chans.empty())
+    buf.resize(pl.capture.buffer ? pl.capture.buffer : std::max<size_t>(cap, 64 * 1024));
+  launch_time = std::chrono::steady_clock::now() - started;
+}
+
+// Readies a finished JobState for another pipeline, keeping every buffer's capacity
+void shpp::detail::JobState::reset(Pipeline p, Output o, Output e)
+{
+  while (!finished())
+    step(-1); // the last run was abandoned by an exception
+  pl = std::move(p);
+  out = std::move(o);
+  err = std::move(e);
+  live = 0;
+  pidfds.clear();
+  remote.close();
+  pgid = 0;
+  kill = Kill::None;
+  timed_out = cancelled = false;
+  failed_stage = -1;
+  timer.close();
+  feed.fd.close();
+  feed.src = nullptr;
+  feed.off = feed.head = 0;
+  feed.chunk.clear();
+  feed.chunk_size = 64 * 1024;
+  feed.splice = true;
+  chans.clear();
+  err_sinks.clear();
+  ep.close();
+  done_ev.close();
+  if (res)
+    spare = std::move(*res);
+  res.reset();
+}
+
+// Collects stage i if it has exited (flags = WNOHANG) or once it does (flags = 0)
+bool shpp::detail::JobState::reap(size_t i, int flags)
+{
+  if (reaped[i])
+    return true;
+  int st = exited_with(127); // stage whose program couldn't be started
+  rusage ru{};
+  if (pids[i] >= 0 && remote.fd >= 0)
+  {
+    while (!reaped[i])
+      if (!recv_exit(flags == 0))
+        return false;
+    return true;
+  }
+#if SHPP_HAVE_PIDFD
+  // Wait on the pidfd itself where the kernel can (5.4+): it names this very process,
+  // so the pid can't have been recycled under us. The raw syscall also fills in rusage.
+  if (pids[i] >= 0 && i < pidfds.size() && pidfds[i].fd >= 0 && waitid_pidfd)
+  {
+    siginfo_t si{};
+    long r;
+    do
+      r = ::syscall(SYS_waitid, P_PIDFD, pidfds[i].fd, &si, WEXITED | (flags & WNOHANG), &ru);
+    while (r < 0 && errno == EINTR);
+    if (r == 0 && si.si_pid == 0)
+      return false; // WNOHANG, still running
+    if (r == 0)
+    {
+      exited(i, wait_status(si), ru);
+      return true;
+    }
+    if (errno != EINVAL)
+      throw std::system_error(errno, std::generic_category(), "waitid");
+    waitid_pidfd = false; // 5.3: pidfd_open but no P_PIDFD
+  }
+#endif
+  if (pids[i] >= 0)
+  {
+    pid_t r;
+    do
+      r = ::wait4(pids[i], &st, flags, &ru);
+    while (r < 0 && errno == EINTR);
+    if (r < 0)
+      throw std::system_error(errno, std::generic_category(), "wait4");
+    if (r == 0)
+      return false;
+  }
+  exited(i, st, ru);
+  return true;
+}
+
+// Records stage i's wait status and usage; with pipefail, the first failure marks the job for police()
+void shpp::detail::JobState::exited(size_t i, int st, const rusage &ru)
+{
+  statuses[i] = st;
+  exit_times[i] = std::chrono::steady_clock::now();
+  auto us = [](const timeval &tv) { return std::chrono::microseconds(int64_t(tv.tv_sec) * 1000000 + tv.tv_usec); };
+  usage[i].user = us(ru.ru_utime);
+  usage[i].sys = us(ru.ru_stime);
+#if defined(__APPLE__)
+  usage[i].max_rss_kb = long(ru.ru_maxrss / 1024); // bytes there
+#else
+  usage[i].max_rss_kb = long(ru.ru_maxrss);
+#endif
+  if (pids[i] >= 0)
+    usage[i].wall = exit_times[i] - spawned_at[i];
+  reaped[i] = 1;
+  --live;
+  if (i < pidfds.size())
+    pidfds[i].close();
+  if (pl.pipefail && st != 0 && failed_stage < 0 && !cut_short(st))
+    failed_stage = int(i);
+}
+
+// A launch that threw partway: SIGKILL and reap the stages already started. Their
+// pipes go too, so nothing pumped is left open and finished() holds for reset().
+void shpp::detail::JobState::abandon()
+{
+  for (size_t i = 0; i < spawned; ++i)
+  {
+    if (pids[i] <= 0 || reaped[i])
+      continue;
+    ::kill(pids[i], SIGKILL);
+    int st = 0;
+    pid_t r;
+    do
+      r = ::waitpid(pids[i], &st, 0);
+    while (r < 0 && errno == EINTR);
+    statuses[i] = st;
+    reaped[i] = 1;
+  }
+  live = 0;
+  pidfds.clear();
+  pipes.clear();
+}
+
+// No pidfds and nothing left to pump: blocks until some stage exits. A group of our own
+// can be waited on as a whole; otherwise sweep all stages with a short, growing nap, not
+// one waitpid per stage in order (which would sit on an early stage that exits last).
+void shpp::detail::JobState::reap_any()
+{
+  for (size_t i = 0; i < spawned; ++i)
+    if (pids[i] < 0)
+      reap(i, WNOHANG);
+  if (live == 0)
+    return;
+  if (pgid > 0)
+  {
+    int st;
+    rusage ru{};
+    pid_t r;
+    do
+      r = ::wait4(-pgid, &st, 0, &ru);
+    while (r < 0 && errno == EINTR);
+    if (r < 0)
+      throw std::system_error(errno, std::generic_category(), "wait4");
+    for (size_t i = 0; i < spawned; ++i)
+      if (pids[i] == r && !reaped[i])
+        exited(i, st, ru);
+    return;
+  }
+  for (useconds_t nap = 1000;; nap = std::min<useconds_t>(nap * 2, 10000))
+  {
+    const size_t before = live;
+    for (size_t i = 0; i < spawned; ++i)
+      reap(i, WNOHANG);
+    if (live < before)
+      return;
+    ::usleep(nap);
+  }
+}
+
+// Clamps a poll timeout so the loop wakes for the next timeout/kill deadline
+int shpp::detail::JobState::until_deadline(int timeout_ms) const
+{
+  if (!has_deadline())
+    return timeout_ms;
+  const auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+  const int ms = int(std::clamp<long long>(left.count(), 0, INT_MAX));
+  return timeout_ms < 0 ? ms : std::min(timeout_ms, ms);
+}
+
+// Escalates once the timeout expired, the token fired or (pipefail) a stage failed: SIGTERM to the stages' group,
+// SIGKILL kill_grace later. Only while one of our stages is unreaped, so the group
+// (which that stage keeps alive) can't be someone else's by then.
+void shpp::detail::JobState::police()
+{
+  if (pgid <= 0 || kill == Kill::Killed)
+    return;
+  bool alive = false;
+  for (size_t i = 0; i < spawned; ++i)
+    alive = alive || (pids[i] > 0 && !reaped[i]);
+  if (!alive)
+    return;
+  const auto now = std::chrono::steady_clock::now();
+  const Kill before = kill;
+  if (kill == Kill::None)
+  {
+    cancelled = pl.cancel && pl.cancel->cancelled();
+    timed_out = !cancelled && pl.timeout.count() > 0 && now >= deadline;
+    if (cancelled || timed_out || failed_stage >= 0)
+    {
+      ::kill(-pgid, SIGTERM);
+      kill = Kill::Termed;
+      deadline = now + pl.kill_grace;
+    }
+  }
+  if (kill == Kill::Termed && now >= deadline)
+  {
+    ::kill(-pgid, SIGKILL);
+    kill = Kill::Killed;
+  }
+  if (kill != before)
+    arm_timer();
+}
+
+void shpp::detail::JobState::arm_timer()
+{
+#if SHPP_HAVE_PIDFD
+  if (timer.fd < 0)
+    return;
+  uint64_t ticks;
+  while (::read(timer.fd, &ticks, sizeof ticks) > 0)
+    ; // consume the expiry that woke us
+  itimerspec its{};
+  if (has_deadline())
+  {
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+    its.it_value.tv_sec = time_t(ns / 1000000000);
+    its.it_value.tv_nsec = long(ns % 1000000000);
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+      its.it_value.tv_nsec = 1; // all-zero would disarm it
+  }
+  ::timerfd_settime(timer.fd, TFD_TIMER_ABSTIME, &its, nullptr); // steady_clock is CLOCK_MONOTONIC
+  if (ep.fd >= 0 && pl.cancel && !watch_cancel())
+    ::epoll_ctl(ep.fd, EPOLL_CTL_DEL, pl.cancel->fd(), nullptr); // stays readable; stop listening
+#endif
+}
+
+// Takes one stage's ExitMsg off the spawn server's reply socket;
+// false if none is waiting (block = false)
+bool shpp::detail::JobState::recv_exit(bool block)
+{
+  ExitMsg msg;
+  ssize_t n;
+  do
+    n = ::recv(remote.fd, &msg, sizeof msg, block ? 0 : MSG_DONTWAIT);
+  while (n < 0 && errno == EINTR);
+  if (n < 0 && !block && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return false;
+  if (n != ssize_t(sizeof msg) || msg.stage < 0 || size_t(msg.stage) >= spawned || reaped[size_t(msg.stage)])
+    throw std::system_error(n < 0 ? errno : ECONNRESET, std::generic_category(), "spawn server");
+  exited(size_t(msg.stage), msg.st, msg.ru);
+  if (live == 0)
+    remote.close();
+  return true;
+}
+
+// One round of the event loop: waits up to timeout_ms (-1 = forever) for pipe or
+// child activity, moves whatever bytes are ready and reaps stages that exited.
+void shpp::detail::JobState::step(int timeout_ms)
+{
+  pfds.clear();
+  if (feed.fd.fd >= 0)
+    pfds.push_back({feed.fd.fd, POLLOUT, 0});
+  for (auto &ch : chans)
+    if (ch.fd.fd >= 0)
+      pfds.push_back({ch.fd.fd, POLLIN, 0});
+  const size_t npump = pfds.size();
+  for (auto &p : pidfds)
+    if (p.fd >= 0)
+      pfds.push_back({p.fd, POLLIN, 0});
+  if (remote.fd >= 0)
+    pfds.push_back({remote.fd, POLLIN, 0});
+  const bool no_waits = pfds.empty();
+  if (watch_cancel())
+    pfds.push_back({pl.cancel->fd(), POLLIN, 0});
+
+  if (no_waits)
+  {
+    // Only children without a pidfd are left: block in waitpid, or nap and sweep
+    if (timeout_ms < 0 && !has_deadline() && !watch_cancel())
+    {
+      reap_any();
+      police();
+      return;
+    }
+    if (timeout_ms != 0)
+      ::usleep(useconds_t(std::min(until_deadline(timeout_ms < 0 ? 10 : timeout_ms), 10)) * 1000);
+    police();
+    for (size_t i = 0; i < spawned; ++i)
+      reap(i, WNOHANG);
+    return;
+  }
+
+  if (::poll(pfds.data(), nfds_t(pfds.size()), until_deadline(timeout_ms)) < 0)
+  {
+    police();
+    if (errno == EINTR)
+      return;
+    throw std::system_error(errno, std::generic_category(), "poll");
+  }
+
+  size_t k = 0;
+  if (feed.fd.fd >= 0)
+  {
+    if (pfds[k].revents & (POLLERR | POLLHUP | POLLNVAL))
+      feed.fd.close(); // reader went away
+    else if (pfds[k].revents & POLLOUT)
+      feed.step();
+    ++k;
+  }
+  for (auto &ch : chans)
+  {
+    if (ch.fd.fd < 0)
+      continue;
+    if (pfds[k].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))
+      ch.step(buf.data(), buf.size(), pl.capture.flush);
+    ++k;
+  }
+  for (size_t i = 0; i < pidfds.size(); ++i)
+  {
+    if (pidfds[i].fd < 0)
+      continue;
+    if (pfds[k].revents)
+      reap(i, WNOHANG);
+    ++k;
+  }
+  if (remote.fd >= 0 && pfds[k].revents)
+    while (remote.fd >= 0 && recv_exit(false))
+      ;
+  if (npump > 0 && pidfds.empty() && remote.fd < 0 && !pumping())
+    for (size_t i = 0; i < spawned; ++i)
+      reap(i, WNOHANG); // pump just drained; most stages are gone too
+  police();
+}
+
+const shpp::Result &shpp::detail::JobState::result()
+{
+  if (!res)
+  {
+    res.emplace(std::move(spare));
+    res->stage_statuses = statuses;
+    res->timed_out = timed_out;
+    res->cancelled = cancelled;
+    res->failed_stage = failed_stage;
+    res->started = started;
+    res->stage_exit_times = exit_times;
+    res->stage_err.swap(stage_err); // the Result's old buffers come back for the next run
+    res->truncated = false;
+    for (auto &ch : chans)
+      res->truncated = res->truncated || ch.truncated;
+    const int last_status = failed_stage >= 0 ? statuses[size_t(failed_stage)] : statuses.back();
+    if (cut_short(last_status))
+      res->exit_code = 0;
+    else if (WIFEXITED(last_status))
+      res->exit_code = WEXITSTATUS(last_status);
+    else if (WIFSIGNALED(last_status))
+      res->exit_code = 128 + WTERMSIG(last_status);
+    else
+      res->exit_code = -1;
+
+    auto hook = Metrics::get().current();
+    if (pl.stats || hook)
+    {
+      Stats &st = res->stats ? *res->stats : res->stats.emplace();
+      st.launch = launch_time;
+      st.wall = std::chrono::steady_clock::now() - started;
+      st.bytes_in = feed.off;
+      st.bytes_out = st.bytes_err = 0;
+      for (size_t k = 0; k < chans.size(); ++k)
+        (k == 0 && stdout_pumped ? st.bytes_out : st.bytes_err) += chans[k].bytes;
+      st.stages.swap(usage);
+    }
+    else
+      res->stats.reset();
+    if (hook)
+      (*hook)(pl, *res);
+  }
+  return *res;
+}
+
+#if SHPP_HAVE_PIDFD
+// One epoll loop on a background thread, shared by every awaiter (and anything else that
+// needs "tell me when this fd is readable" without parking a thread per job).
+class Reactor
+{
+  struct Watch
+  {
+    int fd;
+    std::function<bool()> on_ready;
+  };
+  shpp::detail::Fd ep_;
+
+  void loop()
+  {
+    epoll_event evs[64];
+    for (;;)
+    {
+      int n = ::epoll_wait(ep_.fd, evs, 64, -1);
+      for (int i = 0; i < n; ++i)
+      {
+        auto w = static_cast<Watch *>(evs[i].data.ptr);
+        bool done = true;
+        try
+        {
+          done = w->on_ready();
+        }
+        catch (...)
+        { /* on_ready reports its own errors; drop the watch */
+        }
+        if (done)
+        {
+          delete w;
+          continue;
+        }
+        evs[i].events = EPOLLIN | EPOLLONESHOT;
+        if (::epoll_ctl(ep_.fd, EPOLL_CTL_MOD, w->fd, &evs[i]) < 0)
+          delete w; // fd went away under us
+      }
+    }
+  }
+
+public:
+  Reactor() : ep_(::epoll_create1(EPOLL_CLOEXEC))
+  {
+    if (ep_.fd < 0)
+      throw std::system_error(errno, std::generic_category(), "epoll_create1");
+    std::thread([this] { loop(); }).detach();
+  }
+
+  // Each wakeup is EPOLLONESHOT, so on_ready may resume code that closes fd (closing
+  // drops it from the set); it must not touch fd's owner after deciding to return true.
+  void watch(int fd, std::function<bool()> on_ready)
+  {
+    auto w = new Watch{fd, std::move(on_ready)};
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = w;
+    if (::epoll_ctl(ep_.fd, EPOLL_CTL_ADD, fd, &ev) < 0 &&
+        (errno != EEXIST || ::epoll_ctl(ep_.fd, EPOLL_CTL_MOD, fd, &ev) < 0)) // re-watch after a oneshot
+    {
+      int e = errno;
+      delete w;
+      throw std::system_error(e, std::generic_category(), "epoll_ctl");
+    }
+  }
+
+  static Reactor &get()
+  {
+    static Reactor *r = new Reactor; // never destroyed: its thread runs until exit
+    return *r;
+  }
+};
+#endif
+
+static inline std::unique_ptr<shpp::detail::JobState> start_pipeline(shpp::Pipeline pl,
+                                                                      shpp::Output out,
+                                                                      shpp::Output err)
+{
+  auto st = std::make_unique<shpp::detail::JobState>(std::move(pl), std::move(out), std::move(err));
+  st->launch();
+  return st;
+}
+
+// ===== retries and the result cache behind Pending::run()
+struct CacheEntry
+{
+  shpp::Result res;
+  std::string out, err; // what the sinks were sent
+  std::chrono::steady_clock::time_point expires;
+};
+
+struct ResultCache
+{
+  std::mutex m;
+  std::unordered_map<std::string, CacheEntry> entries;
+  size_t limit = 256;
+
+  static ResultCache &get()
+  {
+    static ResultCache c;
+    return c;
+  }
+
+  std::optional<CacheEntry> find(const std::string &key)
+  {
+    std::lock_guard<std::mutex> lk(m);
+    auto it = entries.find(key);
+    if (it == entries.end())
+      return std::nullopt;
+    if (it->second.expires <= std::chrono::steady_clock::now())
+    {
+      entries.erase(it);
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  void put(std::string key, CacheEntry e)
+  {
+    std::lock_guard<std::mutex> lk(m);
+    trim(limit > 0 ? limit - 1 : 0);
+    if (limit > 0)
+      entries.insert_or_assign(std::move(key), std::move(e));
+  }
+
+  // Expired entries first, then the ones expiring soonest, until at most n are left
+  void trim(size_t n)
+  {
+    if (entries.size() <= n)
+      return;
+    const auto now = std::chrono::steady_clock::now();
+    std::erase_if(entries, [&](const auto &kv) { return kv.second.expires <= now; });
+    while (entries.size() > n)
+      entries.erase(std::min_element(entries.begin(), entries.end(), [](const auto &a, const auto &b) {
+        return a.second.expires < b.second.expires;
+      }));
+  }
+};
+
+static inline void read_all(int fd, std::string &s)
+{
+  char buf[64 * 1024];
+  for (;;)
+  {
+    const ssize_t got = ::read(fd, buf, sizeof buf);
+    if (got > 0)
+      s.append(buf, size_t(got));
+    else if (got == 0)
+      return;
+    else if (errno != EINTR)
+      throw std::system_error(errno, std::generic_category(), "read");
+  }
+}
+
+// Turns the stdin source into bytes every attempt can be fed again: payloads and what
+// streams, fds and files hold end up in `owned` (an InView on the pipeline points at it).
+// Returns the bytes, or nullopt for sources that have none (inherited, /dev/null, closed).
+static std::optional<std::string_view> replayable_input(shpp::Input &src, std::string &owned)
+{
+  if (auto s = std::get_if<shpp::InString>(&src))
+    owned = std::move(s->data);
+  else if (auto v = std::get_if<shpp::InView>(&src))
+    return std::string_view(v->data, v->size);
+  else if (auto st = std::get_if<shpp::InStream>(&src))
+  {
+    char buf[64 * 1024];
+    while (st->is && st->is->read(buf, sizeof buf).gcount() > 0)
+      owned.append(buf, size_t(st->is->gcount()));
+  }
+  else if (auto f = std::get_if<shpp::InFd>(&src))
+    read_all(f->fd, owned);
+  else if (auto fl = std::get_if<shpp::InFile>(&src))
+    read_all(open_redirect(fl->path, O_RDONLY).fd, owned);
+  else
+    return std::nullopt;
+  src = shpp::InView{owned.data(), owned.size()};
+  return std::string_view(owned);
+}
+
+static inline void key_add(std::string &key, std::string_view s)
+{
+  key.append(std::to_string(s.size())).append(1, ':').append(s);
+}
+
+// What decides the output of a command that reads only its arguments, environment and stdin
+static std::string cache_key(const shpp::Pipeline &pl, std::optional<std::string_view> input)
+{
+  std::string key;
+  for (const shpp::Cmd &c : pl.stages)
+  {
+    shpp::Cmd resolved;
+    const shpp::Cmd &argv = c.words.empty() ? c : (resolved = c.expanded());
+    key.append(std::to_string(argv.size())).append(1, '|');
+    for (size_t i = 0; i < argv.size(); ++i)
+      key_add(key, argv[i]);
+  }
+  for (shpp::Stderr e : pl.stage_err)
+    key.push_back(char('0' + int(e)));
+  key.push_back(pl.pipefail ? 'p' : '-');
+
+  char *cwd = ::getcwd(nullptr, 0);
+  key_add(key, cwd ? cwd : "");
+  ::free(cwd);
+  key_add(key, pl.cwd);
+
+  // The environment and stdin go in whole, like argv: a hash could collide into another
+  // command's output
+  key.push_back(pl.env ? 'E' : 'e');
+  if (pl.env)
+    for (const std::string &v : pl.env->vars())
+      key_add(key, v);
+  else
+    for (char **p = environ; p && *p; ++p)
+      key_add(key, *p);
+  key.push_back('|');
+
+  if (input)
+    key_add(key, *input);
+  else
+    key.push_back(char('0' + pl.stdin_src.index())); // inherited, /dev/null or closed
+  return key;
+}
+
+// Hands what a cached or retried run captured to the sink it was meant for
+static void replay(const shpp::Output &o, const std::string &bytes, bool &truncated)
+{
+  if (auto f = std::get_if<shpp::OutFd>(&o.to))
+    write_all(f->fd, bytes.data(), bytes.size());
+  else if (auto fl = std::get_if<shpp::OutFile>(&o.to))
+  {
+    shpp::detail::Fd fd = open_redirect(fl->path, O_WRONLY | O_CREAT | (fl->append ? O_APPEND : O_TRUNC));
+    write_all(fd.fd, bytes.data(), bytes.size());
+  }
+  else if (auto st = std::get_if<shpp::OutString>(&o.to))
+  {
+    st->s->append(bytes, 0, std::min(bytes.size(), st->max_bytes));
+    truncated = truncated || bytes.size() > st->max_bytes;
+  }
+  else if (auto ck = std::get_if<shpp::OutChunk>(&o.to))
+  {
+    if (!bytes.empty())
+      ck->fn(bytes);
+  }
+  else if (auto ln = std::get_if<shpp::OutLine>(&o.to))
+  {
+    std::string carry;
+    split_lines(carry, ln->max_line, bytes.data(), bytes.size(), ln->fn);
+    if (!carry.empty())
+      ln->fn(carry);
+  }
+  else if (auto os = std::get_if<std::ostream *>(&o.to))
+  {
+    (*os)->write(bytes.data(), std::streamsize(bytes.size()));
+    (*os)->flush();
+  }
+}
+
+// The pause before attempt n + 1; false if the cancel token fired during it
+static bool back_off(const shpp::Retry &r, int n, const std::optional<shpp::CancelToken> &cancel)
+{
+  double ms = double(r.delay.count());
+  for (int i = 1; i < n && ms < double(r.max_delay.count()); ++i)
+    ms *= r.factor;
+  ms = std::min(ms, double(r.max_delay.count()));
+  if (r.jitter && ms > 1)
+  {
+    thread_local std::minstd_rand rng{std::random_device{}()};
+    ms = std::uniform_real_distribution<double>(ms / 2, ms)(rng);
+  }
+  const auto until = std::chrono::steady_clock::now() +
+                     std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::duration<double, std::milli>(ms));
+  if (!cancel)
+  {
+    std::this_thread::sleep_until(until);
+    return true;
+  }
+  for (;;)
+  {
+    if (cancel->cancelled())
+      return false;
+    const auto left = std::chrono::ceil<std::chrono::milliseconds>(until - std::chrono::steady_clock::now());
+    if (left.count() <= 0)
+      return true;
+    pollfd p{cancel->fd(), POLLIN, 0};
+    (void)::poll(&p, 1, int(std::min<long long>(left.count(), INT_MAX)));
+  }
+}
+
+// Failures a later attempt may not hit: the system was out of processes, memory or fds
+static inline bool transient(const std::system_error &e)
+{
+  return e.code() == std::errc::resource_unavailable_try_again || e.code() == std::errc::not_enough_memory ||
+         e.code() == std::errc::too_many_files_open || e.code() == std::errc::too_many_files_open_in_system;
+}
+
+static shpp::Result run_repeated(shpp::Pipeline pl, shpp::Output out, shpp::Output err)
+{
+  const bool cached = pl.cache_ttl.count() > 0 && pl.filters.empty();
+  std::string owned;
+  const std::optional<std::string_view> input = replayable_input(pl.stdin_src, owned);
+  std::string key;
+  if (cached)
+  {
+    key = cache_key(pl, input);
+    if (std::optional<CacheEntry> hit = pl.cache_refresh ? std::nullopt : ResultCache::get().find(key))
+    {
+      replay(out, hit->out, hit->res.truncated);
+      replay(err, hit->err, hit->res.truncated);
+      hit->res.cached = true;
+      hit->res.attempts = 0;
+      hit->res.stats.reset(); // nothing ran
+      return std::move(hit->res);
+    }
+  }
+
+  // An attempt whose output may yet be thrown away (or has to be stored) writes into these,
+  // capped like the sink; the last one allowed, and any that rewrites a file of its own
+  // from scratch, write straight into the sink unless the cache needs the bytes
+  std::string got_out, got_err;
+  auto held = [&](const shpp::Output &o, bool last) {
+    if (std::holds_alternative<shpp::OutNull>(o.to))
+      return false;
+    if (auto f = std::get_if<shpp::OutFile>(&o.to); f && !f->append && !cached)
+      return false;
+    return cached || !last;
+  };
+  auto hold = [](const shpp::Output &o, std::string &buf) {
+    auto st = std::get_if<shpp::OutString>(&o.to);
+    return shpp::Output(shpp::into(buf, st ? st->max_bytes : std::string::npos));
+  };
+  const shpp::Retry &r = pl.retry;
+  shpp::Result res;
+  bool held_out = false, held_err = false;
+  int n = 1;
+  for (;; ++n)
+  {
+    const bool last = n >= r.attempts;
+    held_out = held(out, last);
+    held_err = held(err, last);
+    got_out.clear();
+    got_err.clear();
+    try
+    {
+      res = shpp::Job(start_pipeline(pl, held_out ? hold(out, got_out) : out, held_err ? hold(err, got_err) : err))
+              .wait();
+    }
+    catch (const std::system_error &e)
+    {
+      if (last || !transient(e) || !back_off(r, n, pl.cancel))
+        throw;
+      continue;
+    }
+    const bool failed = r.retry_if ? r.retry_if(res) : res.exit_code != 0 || res.timed_out;
+    if (last || res.cancelled || !failed || !back_off(r, n, pl.cancel))
+      break;
+  }
+  res.attempts = n;
+  if (held_out)
+    replay(out, got_out, res.truncated);
+  if (held_err)
+    replay(err, got_err, res.truncated);
+
+  // Output cut at one caller's cap would come back short for the next: not stored
+  if (cached && res.exit_code == 0 && !res.timed_out && !res.cancelled && !res.truncated)
+    ResultCache::get().put(std::move(key),
+                           CacheEntry{res, std::move(got_out), std::move(got_err), std::chrono::steady_clock::now() + pl.cache_ttl});
+  return res;
+}
+
+namespace shpp
+{
+
+  Cmd Cmd::parse(std::string_view s, Expand e)
+  {
+    if (e == Expand::AtRun)
+    {
+      ExpandLater later;
+      detail::tokenize(s, later);
+      if (later.dynamic)
+      {
+        Cmd c;
+        c.words = std::move(later.words);
+        Cmd now = c.expanded(); // argv as of today, for anyone reading it
+        if (now.size() == 0)
+          throw std::runtime_error("empty command");
+        now.words = std::move(c.words);
+        return now;
+      }
+    }
+    Cmd c = split_cmd(s);
+    if (c.size() == 0)
+      throw std::runtime_error("empty command");
+    return c;
+  }
+
+  Cmd Cmd::expanded() const
+  {
+    if (words.empty())
+      return *this;
+    Cmd c;
+    std::string a;
+    for (auto &w : words)
+    {
+      a.clear();
+      for (auto &piece : w)
+      {
+        switch (piece.kind)
+        {
+        case Piece::Text: a += piece.text; break;
+        case Piece::Var: a += get_env(piece.text); break;
+        case Piece::Home: append_home(a); break;
+        }
+      }
+      c.arg(a);
+    }
+    return c;
+  }
+
+  Cmd::Cmd(const Cmd &o) : words(o.words), arena_(o.arena_)
+  {
+    argv_.reserve(o.argv_.size());
+    for (char *p : o.argv_)
+      argv_.push_back(p ? arena_.data() + (p - o.arena_.data()) : nullptr);
+  }
+
+  // Copies into the buffers this Cmd already has, so reassigning one of the same size doesn't allocate
+  Cmd &Cmd::operator=(const Cmd &o)
+  {
+    if (this == &o)
+      return *this;
+    words = o.words;
+    arena_.assign(o.arena_.begin(), o.arena_.end());
+    argv_.clear();
+    for (char *p : o.argv_)
+      argv_.push_back(p ? arena_.data() + (p - o.arena_.data()) : nullptr);
+    return *this;
+  }
+
+  void Cmd::grow(size_t need)
+  {
+    if (need <= arena_.capacity())
+      return;
+    // Grow by hand so argv_ can be moved over while the old buffer is still alive
+    std::vector<char> bigger;
+    bigger.reserve(std::max(need, 2 * arena_.capacity()));
+    bigger.assign(arena_.begin(), arena_.end());
+    for (char *&p : argv_)
+      if (p)
+        p = bigger.data() + (p - arena_.data());
+    arena_.swap(bigger);
+  }
+
+  Cmd &Cmd::reserve(size_t args, size_t bytes)
+  {
+    grow(arena_.size() + bytes);
+    argv_.reserve(std::max<size_t>(argv_.size(), 1) + args);
+    return *this;
+  }
+
+  Cmd &Cmd::arg(std::string_view a)
+  {
+    grow(arena_.size() + a.size() + 1);
+    const size_t at = arena_.size();
+    arena_.insert(arena_.end(), a.begin(), a.end());
+    arena_.push_back('\0');
+    if (argv_.empty())
+      argv_.push_back(nullptr);
+    argv_.back() = arena_.data() + at;
+    argv_.push_back(nullptr);
+    return *this;
+  }
+
+  // Linux also caps each single string at 32 pages (MAX_ARG_STRLEN), whatever ARG_MAX says
+  static inline size_t max_arg_len()
+  {
+#if defined(__linux__)
+    static const size_t n = 32 * size_t(::sysconf(_SC_PAGESIZE));
+    return n;
+#else
+    return SIZE_MAX;
+#endif
+  }
+
+  static inline size_t exec_budget(size_t env_bytes)
+  {
+    const long m = ::sysconf(_SC_ARG_MAX);
+    const size_t total = m > 0 ? size_t(m) : 4096; // _POSIX_ARG_MAX
+    return total > env_bytes + 2048 ? total - env_bytes - 2048 : 0;
+  }
+
+  size_t Cmd::exec_size() const
+  {
+    return arena_.size() + argv_.size() * sizeof(char *);
+  }
+
+  std::vector<Cmd> Cmd::batches(size_t keep, size_t limit) const
+  {
+    if (!words.empty())
+      return expanded().batches(keep, limit);
+    if (size() == 0)
+      return {};
+    keep = std::clamp<size_t>(keep, 1, size()); // the program is never batched
+    Cmd head;
+    for (size_t i = 0; i < keep; ++i)
+      head.arg(argv_[i]);
+    const size_t base = head.exec_size();
+
+    std::vector<Cmd> out;
+    for (size_t i = keep; i < size();)
+    {
+      // Measure first, so each batch is built with one reservation
+      size_t n = 0, bytes = 0, used = base;
+      for (size_t j = i; j < size(); ++j)
+      {
+        const size_t len = std::strlen(argv_[j]) + 1;
+        if (len > max_arg_len() || used + len + sizeof(char *) > limit)
+          break;
+        used += len + sizeof(char *);
+        bytes += len;
+        ++n;
+      }
+      if (n == 0)
+        throw std::runtime_error(std::string("shpp: argument too long for one exec: ") +
+                                 std::string(std::string_view(argv_[i]).substr(0, 64)));
+      Cmd &c = out.emplace_back(head);
+      c.reserve(n, bytes);
+      for (size_t j = i; j < i + n; ++j)
+        c.arg(argv_[j]);
+      i += n;
+    }
+    if (out.empty())
+      out.push_back(std::move(head)); // nothing to split: the fixed part runs once, as xargs does
+    return out;
+  }
+
+  size_t arg_max()
+  {
+    size_t env = sizeof(char *);
+    for (char **p = environ; p && *p; ++p)
+      env += std::strlen(*p) + 1 + sizeof(char *);
+    return exec_budget(env);
+  }
+
+  size_t arg_max(const Env &env)
+  {
+    return exec_budget(env.exec_size());
+  }
+
+  Output detail::shared_sink(const Output &o, Fd &file)
+  {
+    auto fl = std::get_if<OutFile>(&o.to);
+    if (!fl)
+      return o;
+    file = open_redirect(fl->path, O_WRONLY | O_CREAT | (fl->append ? O_APPEND : O_TRUNC));
+    return to_fd(file.fd);
+  }
+
+  void start_spawn_server()
+  {
+    SpawnServer &srv = SpawnServer::get();
+    std::lock_guard<std::mutex> lk(srv.m);
+    srv.start();
+  }
+
+  // ——— CancelToken ———
+  // A pipe that becomes readable once cancelled (and stays so), so poll loops and
+  // Job::fd() can watch it alongside everything else
+  struct CancelToken::State
+  {
+    std::atomic<bool> flag{false};
+    detail::Fd r, w;
+  };
+
+  CancelToken::CancelToken() : st_(std::make_shared<State>())
+  {
+    int fds[2];
+    make_pipe_cloexec(fds);
+    st_->r = detail::Fd(fds[0]);
+    st_->w = detail::Fd(fds[1]);
+    set_nonblock(fds[1]);
+  }
+
+  void CancelToken::cancel() const
+  {
+    if (st_->flag.exchange(true))
+      return;
+    const char c = 1;
+    (void)!::write(st_->w.fd, &c, 1);
+  }
+
+  bool CancelToken::cancelled() const
+  {
+    return st_->flag.load();
+  }
+
+  int CancelToken::fd() const
+  {
+    return st_->r.fd;
+  }
+
+  // ——— In-process stages ———
+  Filter filter(std::function<bool(std::string_view line, const Emit &emit)> fn)
+  {
+    return Filter{std::move(fn), {}};
+  }
+
+  Filter grep(std::string needle, bool invert)
+  {
+    return filter([needle = std::move(needle), invert](std::string_view line, const Emit &emit) {
+      if ((find_fixed(line, needle) != std::string_view::npos) != invert)
+        emit(line);
+      return true;
+    });
+  }
+
+  Filter head(size_t n)
+  {
+    return filter([n, seen = size_t(0)](std::string_view line, const Emit &emit) mutable {
+      if (seen < n)
+        emit(line);
+      return ++seen < n;
+    });
+  }
+
+  Filter count_lines()
+  {
+    auto count = std::make_shared<size_t>(0);
+    return Filter{[count](std::string_view, const Emit &) {
+                    ++*count;
+                    return true;
+                  },
+                  [count](const Emit &emit) { emit(std::to_string(*count)); }};
+  }
+
+  // ——— Env ———
+  // Index of the "key=..." entry in vars, or npos
+  static inline size_t find_var(const std::vector<std::string> &vars, std::string_view key)
+  {
+    for (size_t i = 0; i < vars.size(); ++i)
+    {
+      std::string_view v = vars[i];
+      if (v.size() > key.size() && v[key.size()] == '=' && v.starts_with(key))
+        return i;
+    }
+    return std::string::npos;
+  }
+
+  Env Env::current()
+  {
+    Env e;
+    for (char **p = environ; p && *p; ++p)
+      e.vars_.emplace_back(*p);
+    return e;
+  }
+
+  Env &Env::set(std::string_view key, std::string_view value)
+  {
+    std::string kv;
+    kv.reserve(key.size() + 1 + value.size());
+    kv.append(key).append(1, '=').append(value);
+    if (size_t i = find_var(vars_, key); i != std::string::npos)
+      vars_[i] = std::move(kv);
+    else
+      vars_.push_back(std::move(kv));
+    return *this;
+  }
+
+  Env &Env::unset(std::string_view key)
+  {
+    if (size_t i = find_var(vars_, key); i != std::string::npos)
+      vars_.erase(vars_.begin() + std::ptrdiff_t(i));
+    return *this;
+  }
+
+  size_t Env::exec_size() const
+  {
+    size_t n = (vars_.size() + 1) * sizeof(char *);
+    for (const std::string &v : vars_)
+      n += v.size() + 1;
+    return n;
+  }
+
+  std::optional<std::string_view> Env::get(std::string_view key) const
+  {
+    size_t i = find_var(vars_, key);
+    if (i == std::string::npos)
+      return std::nullopt;
+    return std::string_view(vars_[i]).substr(key.size() + 1);
+  }
+
+  // ——— Core runner ———
+  namespace detail
+  {
+    Fd::Fd(int f) : fd(f) {}
+    Fd::Fd(Fd &&o) noexcept : fd(o.fd)
+    {
+      o.fd = -1;
+    }
+    Fd &Fd::operator=(Fd &&o) noexcept
+    {
+      if (this != &o)
+      {
+        close();
+        fd = o.fd;
+        o.fd = -1;
+      }
+      return *this;
+    }
+    Fd::~Fd()
+    {
+      close();
+    }
+    void Fd::close()
+    {
+      if (fd >= 0)
+      {
+        ::close(fd);
+        fd = -1;
+      }
+    }
+    int Fd::release()
+    {
+      int t = fd;
+      fd = -1;
+      return t;
+    }
+
+  } // namespace detail
+
+  // ——— Pipeline builder that runs on destruction unless .run() was called ———
+  Pending::Pending(Pipeline pl, Output out, Output err)
+    : pl_(std::move(pl)), out_(std::move(out)), err_(std::move(err))
+  {
+  }
+
+  // Disarm moved-from, so its dtor won't auto-run
+  Pending::Pending(Pending &&other) noexcept
+    : pl_(std::move(other.pl_)), out_(std::move(other.out_)), err_(std::move(other.err_)), armed_(other.armed_),
+      background_(other.background_)
+  {
+    other.armed_ = false;
+  }
+
+  Pending &Pending::operator=(Pending &&other) noexcept
+  {
+    if (this != &other)
+    {
+      pl_ = std::move(other.pl_);
+      out_ = std::move(other.out_);
+      err_ = std::move(other.err_);
+      armed_ = other.armed_;
+      background_ = other.background_;
+      other.armed_ = false;
+    }
+    return *this;
+  }
+
+  Pending::~Pending() noexcept
+  {
+    if (armed_)
+    {
+      try
+      {
+        if (background_)
+          (void)detach();
+        else
+          (void)run();
+      }
+      catch (...)
+      { /* never throw from a destructor */
+      }
+    }
+  }
+
+  Pending &&Pending::spawn(Spawn s)
+  {
+    pl_.spawn = s;
+    return std::move(*this);
+  }
+
+  Pending &&Pending::capture(Capture c)
+  {
+    pl_.capture = c;
+    return std::move(*this);
+  }
+
+  Pending &&Pending::env(Env e)
+  {
+    pl_.env = std::move(e);
+    return std::move(*this);
+  }
+
+  Pending &&Pending::env(std::string_view key, std::string_view value)
+  {
+    if (!pl_.env)
+      pl_.env = Env::current();
+    pl_.env->set(key, value);
+    return std::move(*this);
+  }
+
+  Pending &&Pending::clear_env()
+  {
+    pl_.env = Env();
+    return std::move(*this);
+  }
+
+  Pending &&Pending::cwd(std::string path)
+  {
+    pl_.cwd = std::move(path);
+    return std::move(*this);
+  }
+
+  Pending &&Pending::timeout(std::chrono::milliseconds d, std::chrono::milliseconds grace)
+  {
+    pl_.timeout = d;
+    pl_.kill_grace = grace;
+    return std::move(*this);
+  }
+
+  Pending &&Pending::cancel_on(CancelToken t)
+  {
+    pl_.cancel = std::move(t);
+    return std::move(*this);
+  }
+
+  Pending &&Pending::pipefail(bool on)
+  {
+    pl_.pipefail = on;
+    return std::move(*this);
+  }
+
+  Pending &&Pending::stats(bool on)
+  {
+    pl_.stats = on;
+    return std::move(*this);
+  }
+
+  void set_metrics_hook(MetricsHook hook)
+  {
+    Metrics &g = Metrics::get();
+    std::lock_guard<std::mutex> lk(g.m);
+    g.hook = hook ? std::make_shared<const MetricsHook>(std::move(hook)) : nullptr;
+    g.set.store(g.hook != nullptr, std::memory_order_release);
+  }
+
+  Pending &&Pending::in_background()
+  {
+    background_ = true;
+    return std::move(*this);
+  }
+
+  Pending &&Pending::err(Stderr s)
+  {
+    if (pl_.stages.empty())
+      throw std::runtime_error("empty pipeline");
+    pl_.stage_err.resize(pl_.stages.size(), Stderr::Inherit);
+    pl_.stage_err.back() = s;
+    return std::move(*this);
+  }
+
+  Job Pending::start()
+  {
+    armed_ = false;
+    return Job(start_pipeline(std::move(pl_), std::move(out_), std::move(err_)));
+  }
+
+  Pending &&Pending::retry(Retry r)
+  {
+    pl_.retry = std::move(r);
+    return std::move(*this);
+  }
+
+  Pending &&Pending::cache(std::chrono::milliseconds ttl)
+  {
+    pl_.cache_ttl = ttl;
+    return std::move(*this);
+  }
+
+  Pending &&Pending::refresh()
+  {
+    pl_.cache_refresh = true;
+    return std::move(*this);
+  }
+
+  void clear_cache()
+  {
+    ResultCache &c = ResultCache::get();
+    std::lock_guard<std::mutex> lk(c.m);
+    c.entries.clear();
+  }
+
+  void set_cache_limit(size_t entries)
+  {
+    ResultCache &c = ResultCache::get();
+    std::lock_guard<std::mutex> lk(c.m);
+    c.limit = entries;
+    c.trim(entries);
+  }
+
+  shpp::Result Pending::run()
+  {
+    if (pl_.cache_ttl.count() <= 0 && pl_.retry.attempts <= 1)
+      return start().wait();
+    armed_ = false;
+    return run_repeated(std::move(pl_), std::move(out_), std::move(err_));
+  }
+
+  // ——— Runner ———
+  Runner::Runner() = default;
+  Runner::Runner(Runner &&) noexcept = default;
+  Runner &Runner::operator=(Runner &&) noexcept = default;
+  Runner::~Runner()
+  {
+    try
+    {
+      while (st_ && !st_->finished())
+        st_->step(-1); // a run an exception left behind
+    }
+    catch (...)
+    {
+    }
+  }
 
-  // ===== stdin source? (std::variant<std::monostate, in::String, in::Stream>)
-  const bool have_in = !std::holds_alternative<std::monostate>(pl.stdin_src);
-  shpp::detail::Fd inR, inW;
-  if (have_in)
+  const Result &Runner::run(Pending &&p)
   {
-    int fds[2];
-    make_pipe_cloexec(fds);
-    inR = shpp::detail::Fd(fds[0]);
-    inW = shpp::detail::Fd(fds[1]);
+    p.armed_ = false;
+    if (!st_)
+      st_ = std::make_unique<detail::JobState>(std::move(p.pl_), std::move(p.out_), std::move(p.err_));
+    else
+      st_->reset(std::move(p.pl_), std::move(p.out_), std::move(p.err_));
+    st_->launch();
+    while (!st_->finished())
+      st_->step(-1);
+    return st_->result();
   }
 
-  // ===== pipes between stages (stdout chaining)
-  std::vector<std::pair<shpp::detail::Fd, shpp::detail::Fd>> pipes; // (read, write)
-  pipes.reserve(N ? N - 1 : 0);
-  for (size_t i = 0; i + 1 < N; ++i)
+  Runner &Runner::local()
   {
-    int fds[2];
-    make_pipe_cloexec(fds);
-    pipes.emplace_back(shpp::detail::Fd(fds[0]), shpp::detail::Fd(fds[1]));
+    thread_local Runner r;
+    return r;
   }
 
-  // ===== capture pipes ONLY if not going to console
-  shpp::detail::Fd capOutR, capOutW, capErrR, capErrW;
-  if (!to_console_out)
+  // ——— Pull-based lines ———
+  // The stdout channel reads straight into buf (an OutString sink); lines are cut out of
+  // it in place and the consumed prefix is dropped before each read, so buf holds about
+  // one read's worth plus one partial line.
+  struct Lines::State
   {
-    int fds[2];
-    make_pipe_cloexec(fds);
-    capOutR = shpp::detail::Fd(fds[0]);
-    capOutW = shpp::detail::Fd(fds[1]);
+    std::string buf;
+    std::unique_ptr<detail::JobState> job;
+    size_t pos = 0;     // start of the next line
+    size_t scanned = 0; // buf[pos, scanned) has no '\n'
+
+    bool stdout_open() const { return !job->chans.empty() && job->chans.front().fd.fd >= 0; }
+  };
+
+  Lines::Lines(std::unique_ptr<State> st) : st_(std::move(st)) {}
+  Lines::Lines(Lines &&) noexcept = default;
+
+  Lines &Lines::operator=(Lines &&other) noexcept
+  {
+    if (this != &other)
+    {
+      Lines old(std::move(*this)); // finishes what we held
+      st_ = std::move(other.st_);
+      cur_ = other.cur_;
+    }
+    return *this;
   }
-  if (!to_console_err)
+
+  Lines::~Lines() noexcept
   {
-    int fds[2];
-    make_pipe_cloexec(fds);
-    capErrR = shpp::detail::Fd(fds[0]);
-    capErrW = shpp::detail::Fd(fds[1]);
+    if (!st_ || st_->job->res)
+      return;
+    try
+    {
+      if (st_->stdout_open())
+        st_->job->chans.front().fd.close(); // stop reading: writers get SIGPIPE
+      while (!st_->job->finished())
+        st_->job->step(-1);
+    }
+    catch (...)
+    {
+    }
   }
 
-  // ===== fork/exec stages
-  for (size_t i = 0; i < N; ++i)
+  Lines::iterator Lines::begin()
   {
-    pid_t pid = ::fork();
-    if (pid < 0)
-      throw std::system_error(errno, std::generic_category(), "fork");
+    return next() ? iterator(this) : iterator();
+  }
 
-    if (pid == 0)
+  bool Lines::next()
+  {
+    State &s = *st_;
+    for (;;)
     {
-      // ---- Child ----
-
-      // stdin
-      if (i == 0)
+      const char *base = s.buf.data();
+      if (auto nl = static_cast<const char *>(std::memchr(base + s.scanned, '\n', s.buf.size() - s.scanned)))
       {
-        if (have_in)
-          ::dup2(inR.fd, STDIN_FILENO);
-        // else: inherit parent's stdin
+        cur_ = std::string_view(base + s.pos, size_t(nl - base) - s.pos);
+        s.pos = s.scanned = size_t(nl - base) + 1;
+        return true;
       }
-      else
+      s.scanned = s.buf.size();
+      if (!s.stdout_open())
       {
-        ::dup2(pipes[i - 1].first.fd, STDIN_FILENO);
+        if (s.pos == s.buf.size())
+          return false;
+        cur_ = std::string_view(base + s.pos, s.buf.size() - s.pos); // unterminated last line
+        s.pos = s.scanned = s.buf.size();
+        return true;
       }
+      // Need more: drop what was handed out already, then let the child write some
+      s.buf.erase(0, s.pos);
+      s.scanned -= s.pos;
+      s.pos = 0;
+      s.job->step(-1);
+    }
+  }
 
-      // stdout
-      if (i + 1 < N)
-      {
-        ::dup2(pipes[i].second.fd, STDOUT_FILENO);
-      }
-      else
-      {
-        if (!to_console_out)
-        {
-          ::dup2(capOutW.fd, STDOUT_FILENO); // capture
-        }                                    // else: inherit parent's stdout directly (console)
-      }
+  Result Lines::result()
+  {
+    State &s = *st_;
+    while (!s.job->finished())
+    {
+      s.job->step(-1);
+      s.buf.clear();
+      s.pos = s.scanned = 0;
+    }
+    return s.job->result();
+  }
 
-      // stderr
-      if (i + 1 == N)
-      {
-        if (!to_console_err)
+  Lines Pending::lines()
+  {
+    armed_ = false;
+    auto ls = std::make_unique<Lines::State>();
+    ls->job = start_pipeline(std::move(pl_), into(ls->buf), std::move(err_));
+    return Lines(std::move(ls));
+  }
+
+  // ——— co_await support ———
+  namespace detail
+  {
+    void watch(int fd, std::function<bool()> on_ready)
+    {
+#if SHPP_HAVE_PIDFD
+      Reactor::get().watch(fd, std::move(on_ready));
+#else
+      (void)fd;
+      (void)on_ready;
+      throw std::runtime_error("shpp: no reactor on this platform");
+#endif
+    }
+  } // namespace detail
+
+  Awaitable::Awaitable(Pending &&p) : p_(std::move(p)) {}
+
+  bool Awaitable::await_suspend(std::coroutine_handle<> h)
+  {
+    job_.emplace(p_.start());
+    if ((res_ = job_->try_wait()))
+      return false; // already done; don't suspend
+
+    const int fd = job_->fd();
+    if (fd < 0)
+    {
+      // No pollable fd here (no pidfd support): the one case that still parks a thread
+      std::thread([this, h] {
+        try
         {
-          ::dup2(capErrW.fd, STDERR_FILENO); // capture
-        }                                    // else: inherit parent's stderr (console)
-      }
-      // Non-final stages keep default stderr -> parent's stderr
+          res_ = job_->wait();
+        }
+        catch (...)
+        {
+          error_ = std::current_exception();
+        }
+        h.resume();
+      }).detach();
+      return true;
+    }
 
-      // Close fds we don't need in the child
-      for (auto &p : pipes)
+    detail::watch(fd, [this, h] {
+      try
       {
-        p.first.close();
-        p.second.close();
+        res_ = job_->try_wait();
       }
-      if (have_in)
+      catch (...)
       {
-        inR.close();
-        inW.close();
+        error_ = std::current_exception();
       }
-      if (!to_console_out)
+      if (!res_ && !error_)
+        return false; // keep watching
+      h.resume();     // may destroy *this; touch nothing after
+      return true;
+    });
+    return true;
+  }
+
+  Result Awaitable::await_resume()
+  {
+    if (error_)
+      std::rethrow_exception(error_);
+    return std::move(*res_);
+  }
+
+  // ——— Fan-out ———
+  std::vector<Result> parallel(std::vector<Pending> &&jobs, size_t max_concurrency, OnDone on_done, Order order)
+  {
+    const size_t n = jobs.size();
+    max_concurrency = std::max<size_t>(max_concurrency, 1);
+
+    std::vector<std::optional<Result>> results(n);
+    std::vector<std::pair<size_t, Job>> running; // (index, job)
+    running.reserve(std::min(n, max_concurrency));
+    std::vector<pollfd> pfds;
+    size_t next = 0, delivered = 0;
+
+    while (next < n || !running.empty())
+    {
+      while (running.size() < max_concurrency && next < n)
       {
-        capOutR.close();
-        capOutW.close();
+        running.emplace_back(next, jobs[next].start());
+        ++next;
       }
-      if (!to_console_err)
+
+      // Sleep until some job can make progress; jobs without an fd get a short tick
+      pfds.clear();
+      bool all_pollable = true;
+      for (auto &r : running)
       {
-        capErrR.close();
-        capErrW.close();
+        const int fd = r.second.fd();
+        all_pollable = all_pollable && fd >= 0;
+        pfds.push_back({fd, POLLIN, 0}); // poll() ignores negative fds
       }
+      if (::poll(pfds.data(), nfds_t(pfds.size()), all_pollable ? -1 : 10) < 0 && errno != EINTR)
+        throw std::system_error(errno, std::generic_category(), "poll");
 
-      // Build argv and exec
-      const shpp::Cmd &c = pl.stages[i];
-      std::vector<char *> argv;
-      argv.reserve(c.args.size() + 1);
-      for (auto &s : c.args)
-        argv.push_back(const_cast<char *>(s.c_str()));
-      argv.push_back(nullptr);
-
-      ::execvp(c.prog.c_str(), argv.data());
-      std::fprintf(stderr, "execvp(%s) failed: %s\n", c.prog.c_str(), std::strerror(errno));
-      _exit(127);
+      size_t k = 0;
+      for (auto it = running.begin(); it != running.end(); ++k)
+      {
+        std::optional<Result> r;
+        if (pfds[k].fd < 0 || pfds[k].revents)
+          r = it->second.try_wait();
+        if (!r)
+        {
+          ++it;
+          continue;
+        }
+        const size_t i = it->first;
+        results[i] = std::move(*r);
+        it = running.erase(it);
+        if (on_done && order == Order::Completion)
+          on_done(i, *results[i]);
+      }
+      if (on_done && order == Order::Submission)
+        for (; delivered < n && results[delivered]; ++delivered)
+          on_done(delivered, *results[delivered]);
     }
 
-    // ---- Parent ----
-    pids[i] = pid;
-    if (i > 0)
-      pipes[i - 1].first.close(); // parent doesn't read from previous
-    if (i + 1 < N)
-      pipes[i].second.close(); // parent doesn't write to next
+    std::vector<Result> out;
+    out.reserve(n);
+    for (auto &r : results)
+      out.push_back(std::move(*r));
+    return out;
   }
 
-  // Parent: close capture write ends (children inherited dup'd ones)
-  if (!to_console_out)
-    capOutW.close();
-  if (!to_console_err)
-    capErrW.close();
+  // ——— A started pipeline ———
+  Job::Job(std::unique_ptr<detail::JobState> st) : st_(std::move(st)) {}
+  Job::Job(Job &&) noexcept = default;
 
-  // ===== stdin pump (parent writes into inW, then closes to send EOF)
-  std::thread tIn;
-  if (have_in)
+  Job &Job::operator=(Job &&other) noexcept
   {
-    inR.close(); // parent never reads from inR
-    auto write_all = [](int fd, const char *p, size_t n) {
-      while (n)
-      {
-        ssize_t m = ::write(fd, p, n);
-        if (m > 0)
-        {
-          p += m;
-          n -= size_t(m);
-        }
-        else if (m < 0 && errno == EINTR)
-          continue;
-        else
-          break; // error/EPIPE
-      }
-    };
-    int wfd = inW.release(); // hand ownership to thread
-    tIn = std::thread([wfd, src = pl.stdin_src, write_all]() {
-      std::visit(
-        [&](auto &&s) {
-          using T = std::decay_t<decltype(s)>;
-          if constexpr (std::is_same_v<T, std::monostate>) {}
-          else if constexpr (std::is_same_v<T, shpp::InString>)
-          {
-            write_all(wfd, s.data.data(), s.data.size());
-          }
-          else if constexpr (std::is_same_v<T, shpp::InStream>)
-          {
-            if (!s.is)
-              return;
-            char buf[4096];
-            while (s.is->good())
-            {
-              s.is->read(buf, sizeof(buf));
-              std::streamsize got = s.is->gcount();
-              if (got > 0)
-                write_all(wfd, buf, size_t(got));
-            }
-          }
-        },
-        src);
-      ::close(wfd); // EOF to child
-    });
+    if (this != &other)
+    {
+      Job old(std::move(*this)); // waits for what we held
+      st_ = std::move(other.st_);
+    }
+    return *this;
   }
 
-  // ===== capture pumps ONLY if we’re not writing to console
-  std::thread tOut, tErr;
-  if (!to_console_out)
+  Job::~Job() noexcept
   {
-    int out_fd = capOutR.release();
-    tOut = std::thread([out_fd, &out] {
-      char buf[4096];
-      for (;;)
+    if (st_ && !st_->res)
+    {
+      try
       {
-        ssize_t n = ::read(out_fd, buf, sizeof(buf));
-        if (n > 0)
-        {
-          out.write(buf, n);
-          out.flush();
-        }
-        else if (n == 0)
-          break; // EOF
-        else if (errno == EINTR)
-          continue;
-        else
-          break; // read error
+        (void)wait();
       }
-      ::close(out_fd);
-    });
-  }
-  if (!to_console_err)
-  {
-    int err_fd = capErrR.release();
-    tErr = std::thread([err_fd, &err] {
-      char buf[4096];
-      for (;;)
-      {
-        ssize_t n = ::read(err_fd, buf, sizeof(buf));
-        if (n > 0)
-        {
-          err.write(buf, n);
-          err.flush();
-        }
-        else if (n == 0)
-          break;
-        else if (errno == EINTR)
-          continue;
-        else
-          break;
+      catch (...)
+      { /* never throw from a destructor */
       }
-      ::close(err_fd);
-    });
+    }
   }
 
-  // ===== wait for children
-  shpp::Result res;
-  res.stage_statuses.resize(N);
-  int last_status = 0;
-  for (size_t i = 0; i < N; ++i)
+  detail::JobState &Job::state() const
   {
-    int st = 0;
-    if (::waitpid(pids[i], &st, 0) < 0)
-      throw std::system_error(errno, std::generic_category(), "waitpid");
-    res.stage_statuses[i] = st;
-    if (i + 1 == N)
-      last_status = st;
+    if (!st_)
+      throw std::logic_error("shpp: Job used after being moved from");
+    return *st_;
   }
 
-  // ===== joins
-  if (tIn.joinable())
-    tIn.join();
-  if (tOut.joinable())
-    tOut.join();
-  if (tErr.joinable())
-    tErr.join();
-
-  if (WIFEXITED(last_status))
-    res.exit_code = WEXITSTATUS(last_status);
-  else if (WIFSIGNALED(last_status))
-    res.exit_code = 128 + WTERMSIG(last_status);
-  else
-    res.exit_code = -1;
-
-  return res;
-}
+  const std::vector<pid_t> &Job::pids() const
+  {
+    return state().pids;
+  }
 
-namespace shpp
-{
+  Result Job::wait()
+  {
+    detail::JobState &st = state();
+    while (!st.finished())
+      st.step(-1);
+    return st.result();
+  }
 
-  Cmd Cmd::parse(std::string_view s)
+  std::optional<Result> Job::try_wait()
   {
-    auto p = split_cmd(s);
-    if (p.empty())
-      throw std::runtime_error("empty command");
-    Cmd c;
-    c.prog = p[0];
-    c.args = p;
-    return c;
+    detail::JobState &st = state();
+    if (!st.finished())
+      st.step(0);
+    if (!st.finished())
+      return std::nullopt;
+    return st.result();
   }
 
-  // ——— Core runner ———
-  namespace detail
+  std::optional<Result> Job::wait_for_ms(long long ms)
   {
-    Fd::Fd(int f) : fd(f) {}
-    Fd::Fd(Fd &&o) noexcept : fd(o.fd)
+    detail::JobState &st = state();
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    for (;;)
     {
-      o.fd = -1;
+      if (st.finished())
+        return st.result();
+      const auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+      if (left.count() <= 0)
+        return try_wait();
+      st.step(int(std::min<long long>(left.count(), INT_MAX)));
     }
-    Fd &Fd::operator=(Fd &&o) noexcept
+  }
+
+  int Job::fd() const
+  {
+#if SHPP_HAVE_PIDFD
+    detail::JobState &st = state();
+    if (st.pidfds.empty() && st.remote.fd < 0 && st.live > 0)
+      return -1; // child exits wouldn't show up
+    if (st.ep.fd < 0)
     {
-      if (this != &o)
+      st.ep = detail::Fd(::epoll_create1(EPOLL_CLOEXEC));
+      if (st.ep.fd < 0)
+        throw std::system_error(errno, std::generic_category(), "epoll_create1");
+      auto add = [&](int fd, uint32_t events) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (fd >= 0 && ::epoll_ctl(st.ep.fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+          throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+      };
+      add(st.feed.fd.fd, EPOLLOUT);
+      for (auto &ch : st.chans)
+        add(ch.fd.fd, EPOLLIN);
+      for (auto &p : st.pidfds)
+        add(p.fd, EPOLLIN);
+      add(st.remote.fd, EPOLLIN);
+      if (st.pgid > 0)
       {
-        close();
-        fd = o.fd;
-        o.fd = -1;
+        st.timer = detail::Fd(::timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK));
+        if (st.timer.fd < 0)
+          throw std::system_error(errno, std::generic_category(), "timerfd_create");
+        add(st.timer.fd, EPOLLIN);
+        if (st.watch_cancel())
+          add(st.pl.cancel->fd(), EPOLLIN);
+        st.arm_timer();
       }
-      return *this;
     }
-    Fd::~Fd()
+    if (st.finished() && st.done_ev.fd < 0)
     {
-      close();
+      // Nothing left in the set would fire (every stage failed to exec, say): stay readable
+      st.done_ev = detail::Fd(::eventfd(1, EFD_CLOEXEC | EFD_NONBLOCK));
+      epoll_event ev{};
+      ev.events = EPOLLIN;
+      if (st.done_ev.fd < 0 || ::epoll_ctl(st.ep.fd, EPOLL_CTL_ADD, st.done_ev.fd, &ev) < 0)
+        throw std::system_error(errno, std::generic_category(), "eventfd");
     }
-    void Fd::close()
+    return st.ep.fd;
+#else
+    return -1;
+#endif
+  }
+
+  // ——— Detached pipelines ———
+  struct Background::State
+  {
+    Job job; // touched by the reaper thread only
+    std::vector<pid_t> pids;
+    std::optional<Result> res; // set by the reaper, under Reaper::m
+    std::exception_ptr error;
+
+    explicit State(Job j) : job(std::move(j)), pids(job.pids()) {}
+  };
+
+  // The thread that drives every detached pipeline. It starts with the first one and is
+  // never joined, nor is this destroyed: at exit it just goes, as a shell's reaping does.
+  class Reaper
+  {
+    std::mutex m;
+    std::condition_variable cv; // a pipeline finished: wait() and detach() at the limit
+    std::vector<std::shared_ptr<Background::State>> jobs;
+    size_t slots = 0; // admitted, launched or not
+    size_t limit = 256;
+    detail::Fd wake_r, wake_w; // self-pipe: jobs changed
+    bool running = false;
+
+    void run();
+    void finish(const std::shared_ptr<Background::State> &st, std::optional<Result> r, std::exception_ptr e)
     {
-      if (fd >= 0)
+      std::lock_guard<std::mutex> lk(m);
+      st->res = std::move(r);
+      st->error = std::move(e);
+      jobs.erase(std::find(jobs.begin(), jobs.end(), st));
+      --slots;
+      cv.notify_all();
+    }
+
+  public:
+    static Reaper &get()
+    {
+      static Reaper *r = new Reaper; // leaked on purpose, see above
+      return *r;
+    }
+
+    // Blocks until fewer than `limit` detached pipelines are running, then takes a slot
+    void admit()
+    {
+      std::unique_lock<std::mutex> lk(m);
+      cv.wait(lk, [&] { return slots < limit; });
+      ++slots;
+      if (!running)
       {
-        ::close(fd);
-        fd = -1;
+        int fds[2];
+        make_pipe_cloexec(fds);
+        wake_r = detail::Fd(fds[0]);
+        wake_w = detail::Fd(fds[1]);
+        set_nonblock(wake_r.fd);
+        set_nonblock(wake_w.fd);
+        std::thread([this] { run(); }).detach();
+        running = true;
       }
     }
-    int Fd::release()
+
+    void release()
     {
-      int t = fd;
-      fd = -1;
-      return t;
+      std::lock_guard<std::mutex> lk(m);
+      --slots;
+      cv.notify_all();
     }
 
-  } // namespace detail
+    void add(std::shared_ptr<Background::State> st)
+    {
+      std::lock_guard<std::mutex> lk(m);
+      jobs.push_back(std::move(st));
+      const char c = 0;
+      (void)!::write(wake_w.fd, &c, 1);
+    }
 
-  // ——— Pipeline builder that runs on destruction unless .run() was called ———
-  Pending::Pending(Pipeline pl, std::ostream &out, std::ostream &err)
-    : pl_(std::move(pl)), out_(&out), err_(&err)
+    void set_limit(size_t n)
+    {
+      std::lock_guard<std::mutex> lk(m);
+      limit = std::max<size_t>(n, 1);
+      cv.notify_all();
+    }
+
+    template <class Pred>
+    void wait_until(Pred done)
+    {
+      std::unique_lock<std::mutex> lk(m);
+      cv.wait(lk, done);
+    }
+
+    bool check(const Background::State &st)
+    {
+      std::lock_guard<std::mutex> lk(m);
+      return st.res || st.error;
+    }
+  };
+
+  // One poll() over the pipelines' Job::fd()s (plus the wakeup pipe); those without such
+  // an fd are swept with try_wait() every 10 ms
+  void Reaper::run()
   {
+    std::vector<std::shared_ptr<Background::State>> mine;
+    std::vector<pollfd> pfds;
+    std::vector<int> slot_of; // index into pfds per job, -1 = swept
+    for (;;)
+    {
+      {
+        std::lock_guard<std::mutex> lk(m);
+        mine = jobs;
+      }
+      pfds.assign(1, {wake_r.fd, POLLIN, 0});
+      slot_of.assign(mine.size(), -1);
+      bool sweep = false;
+      for (size_t i = 0; i < mine.size(); ++i)
+      {
+        int fd = -1;
+        try
+        {
+          fd = mine[i]->job.fd();
+        }
+        catch (...)
+        {
+        }
+        if (fd >= 0)
+        {
+          slot_of[i] = int(pfds.size());
+          pfds.push_back({fd, POLLIN, 0});
+        }
+        else
+          sweep = true;
+      }
+      (void)::poll(pfds.data(), nfds_t(pfds.size()), sweep ? 10 : -1);
+      char drain[64];
+      while (::read(wake_r.fd, drain, sizeof drain) > 0)
+        ;
+      for (size_t i = 0; i < mine.size(); ++i)
+      {
+        if (slot_of[i] >= 0 && !pfds[size_t(slot_of[i])].revents)
+          continue;
+        std::optional<Result> r;
+        std::exception_ptr e;
+        try
+        {
+          r = mine[i]->job.try_wait();
+        }
+        catch (...)
+        {
+          e = std::current_exception();
+        }
+        if (r || e)
+          finish(mine[i], std::move(r), e);
+      }
+      mine.clear(); // don't keep finished ones alive while blocked
+    }
   }
 
-  // Disarm moved-from, so its dtor won't auto-run
-  Pending::Pending(Pending &&other) noexcept
-    : pl_(std::move(other.pl_)), out_(other.out_), err_(other.err_), armed_(other.armed_)
+  Background::Background(std::shared_ptr<State> st) : st_(std::move(st)) {}
+
+  const std::vector<pid_t> &Background::pids() const
   {
-    other.armed_ = false;
-    other.out_ = nullptr;
-    other.err_ = nullptr;
+    return st_->pids;
   }
 
-  Pending &Pending::operator=(Pending &&other) noexcept
+  bool Background::done() const
   {
-    if (this != &other)
-    {
-      pl_ = std::move(other.pl_);
-      out_ = other.out_;
-      err_ = other.err_;
-      armed_ = other.armed_;
-      other.armed_ = false;
-      other.out_ = nullptr;
-      other.err_ = nullptr;
-    }
-    return *this;
+    return Reaper::get().check(*st_);
   }
 
-  Pending::~Pending() noexcept
+  Result Background::wait() const
   {
-    if (armed_)
+    Reaper::get().wait_until([&] { return st_->res || st_->error; });
+    if (st_->error)
+      std::rethrow_exception(st_->error);
+    return *st_->res;
+  }
+
+  void set_background_limit(size_t n)
+  {
+    Reaper::get().set_limit(n);
+  }
+
+  Background Pending::detach()
+  {
+    Reaper &r = Reaper::get();
+    r.admit();
+    try
     {
-      try
-      {
-        (void)exec_pipeline(pl_, *out_, *err_);
-      }
-      catch (...)
-      { /* never throw from a destructor */
-      }
+      auto st = std::make_shared<Background::State>(start());
+      r.add(st);
+      return Background(std::move(st));
+    }
+    catch (...)
+    {
+      r.release();
+      throw;
     }
   }
 
-  shpp::Result Pending::run()
+  static inline void no_filters_yet(const Pipeline &pl)
   {
-    armed_ = false;
-    return exec_pipeline(pl_, *out_, *err_);
+    if (!pl.filters.empty())
+      throw std::runtime_error("shpp: in-process stages must come after the last program");
   }
 
   shpp::Pending operator|(shpp::Pending &&p, std::string_view rhs)
   {
+    no_filters_yet(p.pl_);
     p.pl_.stages.push_back(shpp::Cmd::parse(rhs));
     return std::move(p);
   }
+
+  shpp::Pending operator|(shpp::Pending &&p, const shpp::Cmd &rhs)
+  {
+    no_filters_yet(p.pl_);
+    p.pl_.stages.push_back(rhs);
+    return std::move(p);
+  }
+
+  shpp::Pending operator|(shpp::Pending &&p, Filter f)
+  {
+    p.pl_.filters.push_back(std::move(f));
+    return std::move(p);
+  }
 } // namespace shpp
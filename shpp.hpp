@@ -1,5 +1,20 @@
 #pragma once
+#include <array>
+#include <cstddef>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <span>
+#include <ranges>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
 #include <variant>
 #include <vector>
 
@@ -9,53 +24,360 @@ namespace shpp
   {
     std::string data;
   };
+  struct InView
+  {
+    const char *data;
+    size_t size;
+  }; // non-owning; must outlive the job and stay unchanged until it's done
   struct InStream
   {
     std::istream *is;
   }; // non-owning; must outlive run()
+  struct InFd
+  {
+    int fd;
+  }; // non-owning; dup2'd onto the first stage's stdin (file, socket, pipe), needed only until start()
+  struct InFile
+  {
+    std::string path;
+  }; // opened at start() and dup2'd onto stdin, like the shell's `< path`
+  struct InNull
+  {
+  }; // `< /dev/null`: reads see EOF at once
+  struct InClosed
+  {
+  }; // `<&-`: stdin is closed in the child (its first open() then gets fd 0)
 
   // The type stored on the pipeline
-  using Input = std::variant<std::monostate, InString, InStream>;
+  using Input = std::variant<std::monostate, InString, InView, InStream, InFd, InFile, InNull, InClosed>;
 
   // Factories (named on purpose; no implicit conversions)
-  inline InString in(std::string s)
+  inline InString in(std::string s) // in(std::move(s)) hands a big payload over without a copy
   {
     return {std::move(s)};
   }
-  inline InString in(std::string_view sv)
+  inline InView in(std::string_view sv) // borrowed
   {
-    return {std::string(sv)};
+    return {sv.data(), sv.size()};
+  }
+  inline InView in(std::span<const std::byte> bytes) // borrowed binary data
+  {
+    return {reinterpret_cast<const char *>(bytes.data()), bytes.size()};
   }
   inline InStream in(std::istream &is)
   {
     return {&is};
   }
+  inline InFd in_fd(int fd)
+  {
+    return {fd};
+  }
+  inline InFile in_file(std::string path)
+  {
+    return {std::move(path)};
+  }
+  inline InNull in_null()
+  {
+    return {};
+  }
+  inline InClosed in_closed()
+  {
+    return {};
+  }
 
   // ——— Sinks (where output goes) ———
+  struct OutFd
+  {
+    int fd;
+  }; // non-owning; the final stage writes straight into it, needed only until start()
+  struct OutFile
+  {
+    std::string path;
+    bool append;
+  }; // opened at start() and dup2'd, like the shell's `> path` / `>> path`
+  struct OutString
+  {
+    std::string *s;
+    size_t max_bytes; // appended at most; the rest is drained and dropped (Result::truncated)
+    size_t reserve;   // capacity to set aside up front
+  }; // non-owning; appended to straight from read(), no ostream involved
+  struct OutChunk
+  {
+    std::function<void(std::string_view)> fn;
+  }; // called with every read(); the view points into shpp's buffer and lives for the call
+  struct OutLine
+  {
+    std::function<void(std::string_view)> fn;
+    size_t max_line; // longer lines are handed over in pieces of this many bytes
+  }; // called once per line, without its '\n' (and for an unterminated last line)
+  struct OutNull
+  {
+  }; // `> /dev/null`: the stage writes straight into it, nothing is pumped
+
+  inline OutFd to_fd(int fd)
+  {
+    return {fd};
+  }
+  inline OutFile to_file(std::string path, bool append = false)
+  {
+    return {std::move(path), append};
+  }
+  inline OutString into(std::string &s, size_t max_bytes = std::string::npos, size_t reserve = 0)
+  {
+    return {&s, max_bytes, reserve};
+  }
+  inline OutChunk on_chunk(std::function<void(std::string_view)> fn)
+  {
+    return {std::move(fn)};
+  }
+  inline OutLine on_line(std::function<void(std::string_view)> fn, size_t max_line = 1 << 20)
+  {
+    return {std::move(fn), max_line};
+  }
+  inline OutNull to_null()
+  {
+    return {};
+  }
+
+  // One destination; converts from std::ostream& so SS{out, err} reads as before
+  struct Output
+  {
+    std::variant<std::ostream *, OutFd, OutFile, OutString, OutChunk, OutLine, OutNull> to;
+    Output(std::ostream &os) : to(&os) {}
+    Output(OutFd f) : to(f) {}
+    Output(OutFile f) : to(std::move(f)) {}
+    Output(OutString s) : to(s) {}
+    Output(OutChunk c) : to(std::move(c)) {}
+    Output(OutLine l) : to(std::move(l)) {}
+    Output(OutNull n) : to(n) {}
+  };
+
   struct CC_t
   {
   };
   inline constexpr CC_t CC{}; // console stdout+stderr
+  struct NN_t
+  {
+  };
+  inline constexpr NN_t NN{}; // stdout+stderr -> /dev/null
   struct SC_t
   {
-    std::ostream &out;
+    Output out;
   }; // stdout -> out, stderr -> std::cerr
   struct CS_t
   {
-    std::ostream &err;
+    Output err;
   }; // stdout -> std::cout, stderr -> err
 
   struct SS_t
   {
-    std::ostream &out;
-    std::ostream &err;
+    Output out;
+    Output err;
   }; // split streams
 
+  // When $VAR / ~ in a command string are resolved
+  enum class Expand
+  {
+    Now,   // once, by Cmd::parse(): the environment is frozen into args
+    AtRun, // again at every launch, against the environment of that moment
+  };
+
+  class Env;
+
+  // Bytes one exec has left for argv: sysconf(_SC_ARG_MAX) less the environment (this
+  // process's, or the Env the pipeline will pass) and 2 KiB of headroom, as xargs reckons it
+  size_t arg_max();
+  size_t arg_max(const Env &env);
+
+  // A parsed command. Parse once and reuse it (CC % cmd, p | cmd) to skip re-tokenizing.
+  // The argv lives in one NUL-separated buffer with the char* table execvp wants kept
+  // next to it, so launching a stage never allocates or copies arguments.
   struct Cmd
   {
-    std::string prog;
-    std::vector<std::string> args; // args[0] should be prog for execvp
-    static Cmd parse(std::string_view s);
+    Cmd() = default;
+    Cmd(const Cmd &o);
+    Cmd &operator=(const Cmd &o);
+    Cmd(Cmd &&) noexcept = default;
+    Cmd &operator=(Cmd &&) noexcept = default;
+
+    Cmd &arg(std::string_view a); // appends one argument; the first one is the program
+    template <std::ranges::input_range R>
+      requires std::convertible_to<std::ranges::range_reference_t<R>, std::string_view>
+    Cmd &args(R &&r); // appends each element; a forward range is measured and reserved for first
+    Cmd &reserve(size_t args, size_t bytes); // room for `args` more arguments of `bytes` in all
+
+    size_t exec_size() const; // what these args cost against arg_max(): strings, NULs and pointers
+    // Splits the args into commands that each fit in `limit`, all starting with the first
+    // `keep` words (program and fixed options), like xargs; throws if one argument can't fit
+    std::vector<Cmd> batches(size_t keep = 1, size_t limit = arg_max()) const;
+
+    const char *prog() const { return argv_.empty() ? "" : argv_[0]; }
+    size_t size() const { return argv_.empty() ? 0 : argv_.size() - 1; } // argc
+    std::string_view operator[](size_t i) const { return argv_[i]; }
+    char *const *argv() const // nullptr-terminated, even for an empty Cmd
+    {
+      static char *const none[] = {nullptr};
+      return argv_.empty() ? none : argv_.data();
+    }
+
+    struct Piece
+    {
+      enum Kind : unsigned char
+      {
+        Text,
+        Var, // text is the variable name
+        Home,
+      } kind;
+      std::string text;
+    };
+    using Word = std::vector<Piece>;
+    std::vector<Word> words; // Expand::AtRun only: args with $VAR / ~ still unresolved
+
+    static Cmd parse(std::string_view s, Expand e = Expand::Now);
+    Cmd expanded() const; // args resolved against the current environment
+
+  private:
+    void grow(size_t need); // arena_ capacity >= need, argv_ rebased
+
+    std::vector<char> arena_;  // every argument, NUL-terminated, back to back
+    std::vector<char *> argv_; // into arena_; nullptr-terminated once there is an argument
+  };
+
+  template <std::ranges::input_range R>
+    requires std::convertible_to<std::ranges::range_reference_t<R>, std::string_view>
+  Cmd &Cmd::args(R &&r)
+  {
+    if constexpr (std::ranges::forward_range<R>)
+    {
+      size_t n = 0, bytes = 0;
+      for (auto &&a : r)
+      {
+        ++n;
+        bytes += std::string_view(a).size() + 1;
+      }
+      reserve(n, bytes);
+    }
+    for (auto &&a : r)
+      arg(std::string_view(a));
+    return *this;
+  }
+
+  // cmd("tar").arg("-rf").arg(archive).args(files): argv built in place, nothing parsed
+  inline Cmd cmd(std::string_view prog)
+  {
+    Cmd c;
+    c.arg(prog);
+    return c;
+  }
+
+  // ——— Environment block for a pipeline's children ———
+  // "K=V" entries handed to the exec instead of this process's environ.
+  class Env
+  {
+  public:
+    Env() = default;      // empty: the children see no variables at all
+    static Env current(); // a copy of this process's environ
+
+    Env &set(std::string_view key, std::string_view value);
+    Env &unset(std::string_view key);
+    std::optional<std::string_view> get(std::string_view key) const;
+    const std::vector<std::string> &vars() const { return vars_; }
+    size_t exec_size() const; // what the block costs against ARG_MAX: strings, NULs and pointers
+
+  private:
+    std::vector<std::string> vars_; // "K=V"
+  };
+
+  // ——— How stages are launched ———
+  enum class Spawn
+  {
+    Auto,       // PosixSpawn where the platform has it, Fork otherwise
+    PosixSpawn, // posix_spawn(): vfork-style, launch cost doesn't grow with parent RSS
+    Fork,       // fork() + execve(): the classic path, kept as a fallback
+    Server,     // ask the spawn server to launch them (see start_spawn_server())
+  };
+
+  // Forks shpp's spawn server: a small helper that launches Spawn::Server pipelines on
+  // our behalf, so their launch cost doesn't depend on how large or threaded this process
+  // has grown. Call it early in main(), before any thread is started (shpp's own reactor
+  // and reaper included): the server is a fork that never execs, and must not inherit a
+  // lock another thread held. Throws std::runtime_error once there are threads (where
+  // that can be told), std::system_error if the fork fails. Until it has run,
+  // Spawn::Server pipelines launch with Spawn::Auto. The server exits when this process does.
+  void start_spawn_server();
+
+  // ——— How captured output is pumped into streams ———
+  enum class Flush
+  {
+    End,   // once, when the stream's output is complete
+    Line,  // after reads that contain a newline
+    Chunk, // after every read
+    Never, // leave it to the stream
+  };
+
+  struct Capture
+  {
+    size_t buffer = 0;    // bytes per read(); 0 = the pipe's capacity, at least 64 KiB
+    Flush flush = Flush::End;
+    size_t pipe_size = 0; // F_SETPIPE_SZ for shpp's pipes (Linux); 0 = kernel default
+
+    static Capture interactive() { return {4096, Flush::Line, 0}; }
+    static Capture bulk() { return {1 << 20, Flush::End, 1 << 20}; }
+  };
+
+  // Where one stage's stderr goes; set with Pending::err() on the stage added last
+  enum class Stderr
+  {
+    Inherit, // last stage: the pipeline's stderr sink; the others: the parent's stderr
+    Merge,   // 2>&1: wherever the stage's stdout goes (the next stage, or the stdout sink)
+    Capture, // into Result::stage_err[i]
+    Null,    // 2>/dev/null
+  };
+
+  // ——— Cancellation ———
+  // Copies share one flag. cancel() stops every pipeline started with the token, running or
+  // not yet started: SIGTERM to its process group, then SIGKILL after the kill grace period.
+  class CancelToken
+  {
+  public:
+    CancelToken(); // throws std::system_error
+    void cancel() const;
+    bool cancelled() const;
+    int fd() const; // readable once cancelled
+
+  private:
+    struct State;
+    std::shared_ptr<State> st_;
+  };
+
+  // ——— In-process stages: `| grep("x")`, `| head(10)`, `| count_lines()`, `| filter(fn)` ———
+  // They run inside shpp's pump on the last program's stdout, one line (without its '\n')
+  // at a time, instead of forking another program, and come after the last program only.
+  using Emit = std::function<void(std::string_view line)>; // passes a line downstream
+  struct Filter
+  {
+    std::function<bool(std::string_view line, const Emit &emit)> line; // false: no more input, please
+    std::function<void(const Emit &emit)> end;                        // optional; once input is over
+  };
+  Filter filter(std::function<bool(std::string_view line, const Emit &emit)> fn);
+  Filter grep(std::string needle, bool invert = false); // fixed string, like grep -F [-v]
+  Filter head(size_t n);    // then closes the pipe: the programs upstream get SIGPIPE and stop
+  Filter count_lines();     // emits the number of lines, like wc -l
+
+  // ——— Repeating a run: retries with backoff, and a result cache (Pending::retry(), ::cache()) ———
+  // A retried run waits delay, then delay * factor, ... (capped at max_delay, each drawn from
+  // its upper half when jitter is on) before running the same Pipeline again; a cancel token
+  // cuts the wait short. Fork/pipe failures for lack of resources (EAGAIN, ENOMEM, EMFILE,
+  // ENFILE) are retried too; any other exception ends it.
+  struct Result;
+  struct Retry
+  {
+    int attempts = 1; // runs in all, the first one included; 1 = no retries
+    std::chrono::milliseconds delay{100};
+    double factor = 2;
+    std::chrono::milliseconds max_delay = std::chrono::seconds(5);
+    bool jitter = true;
+    std::function<bool(const Result &r)> retry_if{}; // empty: exit_code != 0 or timed_out
   };
 
   // Pipeline carries an Input instead of enum+fields
@@ -63,18 +385,264 @@ namespace shpp
   {
     std::vector<Cmd> stages;
     Input stdin_src; // monostate = none
+    Spawn spawn = Spawn::Auto;
+    Capture capture;
+    std::optional<Env> env; // nullopt = inherit environ
+    std::string cwd;        // every stage starts here; empty = the parent's cwd
+    // With a timeout or a cancel token the stages get their own process group, which
+    // is sent SIGTERM on expiry and SIGKILL kill_grace later if anything is still alive
+    std::chrono::milliseconds timeout{0}; // 0 = none; counted from launch
+    std::chrono::milliseconds kill_grace = std::chrono::seconds(2);
+    std::optional<CancelToken> cancel;
+    bool pipefail = false; // the first stage to fail gets the rest signalled like a timeout, and sets exit_code
+    std::vector<Filter> filters; // in-process stages after the last program, in order
+    std::vector<Stderr> stage_err; // by stage; stages past its end are Stderr::Inherit
+    bool stats = false;            // fill in Result::stats
+    Retry retry;                   // with run(): how often to try again while it fails
+    std::chrono::milliseconds cache_ttl{0}; // with run(): reuse a successful Result this long; 0 = never
+    bool cache_refresh = false;    // run anyway and replace the cached Result
+  };
+
+  // ——— Instrumentation: Result::stats, with Pending::stats() or a metrics hook ———
+  struct StageStats
+  {
+    std::chrono::nanoseconds spawn{0}; // in fork()/posix_spawn(); the latter returns once the child exec'd
+    std::chrono::nanoseconds wall{0};  // spawned to reaped
+    std::chrono::microseconds user{0}; // CPU time, from the child's rusage
+    std::chrono::microseconds sys{0};
+    long max_rss_kb = 0;
+  };
+  struct Stats
+  {
+    std::chrono::nanoseconds launch{0}; // pipes, PATH lookups and every spawn
+    std::chrono::nanoseconds wall{0};   // launch to the Result
+    size_t bytes_in = 0;  // fed to the first stage's stdin from memory or a stream
+    size_t bytes_out = 0; // pumped from the last stage's stdout (0 when it writes to an fd itself)
+    size_t bytes_err = 0; // pumped from stderr: the sink's pipe and the Stderr::Capture ones
+    std::vector<StageStats> stages;
   };
 
   // ——— Result ———
   struct Result
   {
-    int exit_code = 0;               // of the *last* stage
+    int exit_code = 0;               // of the *last* program (with pipefail: of failed_stage, if any)
     std::vector<int> stage_statuses; // wait status for each stage
+    bool truncated = false;          // an into(s, max_bytes) sink dropped output past its cap
+    bool timed_out = false;          // Pipeline::timeout expired and the stages were signalled
+    bool cancelled = false;          // the CancelToken fired first
+    int failed_stage = -1;           // pipefail: the first stage that exited non-zero
+    std::chrono::steady_clock::time_point started;                     // launch
+    std::vector<std::chrono::steady_clock::time_point> stage_exit_times; // when each stage was reaped
+    std::vector<std::string> stage_err; // by stage: what Stderr::Capture stages wrote, "" for the rest
+    std::optional<Stats> stats;         // with Pipeline::stats or a metrics hook set
+    int attempts = 1;                   // runs it took (Pipeline::retry); 0 when it came from the cache
+    bool cached = false;                // replayed from the result cache: nothing was spawned
   };
 
+  // Called with every pipeline's Result (stats filled in) on the thread that collects it,
+  // for exporting metrics without wrapping each call; an empty function removes it.
+  using MetricsHook = std::function<void(const Pipeline &pl, const Result &r)>;
+  void set_metrics_hook(MetricsHook hook);
+
   // ——— Core runner ———
   namespace detail
   {
+    // Extended splitter: quotes, escapes, $VAR/${VAR}, ~ at word start.
+    // Throws std::runtime_error on unmatched quotes (a build error when constant-evaluated).
+    // The state machine reports to `out`: ch(c) for literal characters, var(name) for
+    // $VAR/${VAR}, home() for a leading ~, and end_word() after each word; what those
+    // expand to is up to the sink (now, or at every launch for Expand::AtRun).
+    template <class Out>
+    constexpr void tokenize(std::string_view s, Out &out)
+    {
+      enum class State { Unquoted, InSingle, InDouble };
+      State st = State::Unquoted;
+
+      const auto push_token = [&]() { out.end_word(); };
+
+      // C-locale character classes, spelled out so this also runs at compile time
+      auto is_space = [](char c) { return c == ' ' || (c >= '\t' && c <= '\r'); };
+      auto is_alpha = [](char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); };
+      auto is_name_start = [&](char c) { return is_alpha(c) || c == '_'; };
+      auto is_name_char = [&](char c) { return is_alpha(c) || (c >= '0' && c <= '9') || c == '_'; };
+
+      bool in_token = false;     // whether we're currently building a token (even if it's empty so far)
+      bool at_word_start = true; // for ~ expansion in unquoted context
+
+      for (size_t i = 0; i < s.size(); ++i)
+      {
+        char c = s[i];
+
+        if (st == State::Unquoted)
+        {
+          if (is_space(c))
+          {
+            if (in_token)
+            {
+              push_token();
+              in_token = false;
+            }
+            at_word_start = true;
+            continue;
+          }
+
+          if (c == '\'')
+          {
+            st = State::InSingle;
+            in_token = true;
+            at_word_start = false;
+            continue;
+          }
+          if (c == '"')
+          {
+            st = State::InDouble;
+            in_token = true;
+            at_word_start = false;
+            continue;
+          }
+
+          if (c == '\\')
+          {
+            in_token = true;
+            at_word_start = false;
+            if (i + 1 < s.size())
+            {
+              out.ch(s[++i]);
+            }
+            else
+            {
+              out.ch('\\');
+            }
+            continue;
+          }
+
+          if (c == '~' && at_word_start)
+          {
+            in_token = true;
+            at_word_start = false;
+            out.home();
+            continue;
+          }
+
+          if (c == '$')
+          {
+            in_token = true;
+            at_word_start = false;
+            // ${VAR}
+            if (i + 1 < s.size() && s[i + 1] == '{')
+            {
+              size_t j = i + 2, end = j;
+              while (end < s.size() && s[end] != '}')
+                ++end;
+              if (end >= s.size())
+                throw std::runtime_error("Unclosed ${...} in command");
+              out.var(s.substr(j, end - j));
+              i = end; // skip '}'
+              continue;
+            }
+            // $VAR
+            size_t j = i + 1;
+            if (j < s.size() && is_name_start(s[j]))
+            {
+              ++j;
+              while (j < s.size() && is_name_char(s[j]))
+                ++j;
+              out.var(s.substr(i + 1, j - (i + 1)));
+              i = j - 1;
+            }
+            else
+            {
+              // Not a valid name start; treat '$' literally.
+              out.ch('$');
+            }
+            continue;
+          }
+
+          // normal char
+          out.ch(c);
+          in_token = true;
+          at_word_start = false;
+          continue;
+        }
+
+        if (st == State::InSingle)
+        {
+          if (c == '\'')
+          {
+            st = State::Unquoted;
+            continue;
+          }
+          out.ch(c); // no escapes, no env expansion
+          in_token = true;
+          continue;
+        }
+
+        // State::InDouble
+        if (c == '"')
+        {
+          st = State::Unquoted;
+          at_word_start = false;
+          continue;
+        }
+        if (c == '\\')
+        {
+          if (i + 1 < s.size())
+          {
+            out.ch(s[++i]);
+          }
+          else
+          {
+            out.ch('\\');
+          }
+          in_token = true;
+          continue;
+        }
+        if (c == '$')
+        {
+          // env expansion allowed in double quotes
+          if (i + 1 < s.size() && s[i + 1] == '{')
+          {
+            size_t j = i + 2, end = j;
+            while (end < s.size() && s[end] != '}')
+              ++end;
+            if (end >= s.size())
+              throw std::runtime_error("Unclosed ${...} in command");
+            out.var(s.substr(j, end - j));
+            i = end;
+          }
+          else
+          {
+            size_t j = i + 1;
+            if (j < s.size() && is_name_start(s[j]))
+            {
+              ++j;
+              while (j < s.size() && is_name_char(s[j]))
+                ++j;
+              out.var(s.substr(i + 1, j - (i + 1)));
+              i = j - 1;
+            }
+            else
+            {
+              out.ch('$');
+            }
+          }
+          in_token = true;
+          continue;
+        }
+        // normal char inside double quotes
+        out.ch(c);
+        in_token = true;
+      }
+
+      if (st == State::InSingle)
+        throw std::runtime_error("Unclosed single quote in command");
+      if (st == State::InDouble)
+        throw std::runtime_error("Unclosed double quote in command");
+
+      if (in_token)
+        push_token();
+    }
+
 
     struct Fd
     {
@@ -89,26 +657,330 @@ namespace shpp
       void close();
       int release();
     };
+
+    struct JobState;
+  } // namespace detail
+
+  // ——— Commands tokenized at compile time: CC % "grep -F foo"_cmd ———
+  namespace detail
+  {
+    template <size_t N>
+    struct Literal
+    {
+      char s[N];
+      consteval Literal(const char (&str)[N])
+      {
+        for (size_t i = 0; i < N; ++i)
+          s[i] = str[i];
+      }
+      constexpr std::string_view view() const { return {s, N - 1}; }
+    };
+
+    // tokenize() pass 1: sizes, and whether the words depend on the environment
+    struct CountWords
+    {
+      size_t words = 0;
+      size_t bytes = 0; // one NUL per word included
+      bool dynamic = false;
+      constexpr void ch(char) { ++bytes; }
+      constexpr void var(std::string_view) { dynamic = true; }
+      constexpr void home() { dynamic = true; }
+      constexpr void end_word()
+      {
+        ++words;
+        ++bytes;
+      }
+    };
+
+    // tokenize() pass 2: NUL-separated words into fixed-size arrays
+    template <size_t W, size_t B>
+    struct FillWords
+    {
+      std::array<char, B> buf{};
+      std::array<size_t, W> off{};
+      size_t w = 0, b = 0;
+      constexpr void ch(char c) { buf[b++] = c; }
+      constexpr void var(std::string_view) {}
+      constexpr void home() {}
+      constexpr void end_word()
+      {
+        buf[b++] = '\0';
+        if (++w < W)
+          off[w] = b; // next word starts here
+      }
+    };
   } // namespace detail
 
+  // W words in one fixed buffer; no heap, no run-time tokenizing
+  template <size_t W, size_t B>
+  struct StaticCmd
+  {
+    std::array<char, B> buf; // each word NUL-terminated
+    std::array<size_t, W> off;
+
+    std::array<const char *, W + 1> argv() const // nullptr-terminated, for execvp
+    {
+      std::array<const char *, W + 1> a{};
+      for (size_t i = 0; i < W; ++i)
+        a[i] = buf.data() + off[i];
+      return a;
+    }
+    operator Cmd() const
+    {
+      Cmd c;
+      for (size_t i = 0; i < W; ++i)
+        c.arg(buf.data() + off[i]);
+      return c;
+    }
+  };
+
+  // A literal with $VAR or ~ can't be resolved at build time; it is tokenized when used
+  template <size_t N>
+  struct DeferredCmd
+  {
+    detail::Literal<N> src;
+    operator Cmd() const { return Cmd::parse(src.view()); }
+  };
+
+  inline namespace literals
+  {
+    // Unmatched quotes and empty commands fail the build instead of throwing at run time
+    template <detail::Literal S>
+    consteval auto operator""_cmd()
+    {
+      constexpr detail::CountWords n = [] {
+        detail::CountWords c;
+        detail::tokenize(S.view(), c);
+        return c;
+      }();
+      static_assert(n.words > 0, "empty command");
+      if constexpr (n.dynamic)
+        return DeferredCmd<sizeof(S.s)>{S};
+      else
+      {
+        detail::FillWords<n.words, n.bytes> f;
+        detail::tokenize(S.view(), f);
+        return StaticCmd<n.words, n.bytes>{f.buf, f.off};
+      }
+    }
+  } // namespace literals
+
+  // ——— A started pipeline; the stages run while you do other work ———
+  // Pumping stdin/stdout/stderr happens inside wait()/try_wait()/wait_for(), on the calling thread.
+  class Job
+  {
+    std::unique_ptr<detail::JobState> st_;
+    std::optional<Result> wait_for_ms(long long ms);
+    detail::JobState &state() const; // throws std::logic_error on a moved-from Job
+
+  public:
+    explicit Job(std::unique_ptr<detail::JobState> st);
+    Job(Job &&) noexcept;
+    Job &operator=(Job &&other) noexcept;
+    ~Job() noexcept; // waits for the stages if nobody did
+
+    const std::vector<pid_t> &pids() const; // -1 for a stage whose program couldn't be started
+    Result wait();                          // until every stage exited and all output is pumped
+    std::optional<Result> try_wait();       // never blocks; nullopt while still running
+    template <class Rep, class Period>
+    std::optional<Result> wait_for(std::chrono::duration<Rep, Period> timeout)
+    {
+      return wait_for_ms(std::chrono::ceil<std::chrono::milliseconds>(timeout).count());
+    }
+    // Readable when try_wait() can make progress: an epoll set over the stages' pidfds, the
+    // pump pipes and the timeout/cancellation wakeups on Linux. -1 where there is no such fd (poll try_wait() on a timer instead).
+    int fd() const;
+  };
+
+  // ——— Detached pipelines: `CC & "cmd"`, or p.detach() for a handle ———
+  // One shared reaper thread drives them all (one poll() over their Job::fd()s on Linux, a
+  // short sweep elsewhere) and pumps their sinks: give them sinks that thread may write to
+  // (console, to_file/to_fd, NN), or wait() on the handle before touching a capture.
+  class Background
+  {
+  public:
+    struct State;
+    explicit Background(std::shared_ptr<State> st);
+
+    const std::vector<pid_t> &pids() const;
+    bool done() const;
+    Result wait() const; // until the reaper has collected it; rethrows what it threw
+
+  private:
+    std::shared_ptr<State> st_;
+  };
+  // Detached pipelines allowed to run at once (default 256); detach() blocks for a free slot
+  void set_background_limit(size_t n);
+
+  // ——— Pull-based range over the last stage's stdout: for (std::string_view l : p.lines()) ———
+  // Reads only when the loop asks for the next line, so a consumer that pauses pauses the
+  // child too (its pipe fills up). Each line comes without its '\n' and stays valid until
+  // the next increment. Leaving early closes the pipe (the stages see SIGPIPE) and waits.
+  class Lines
+  {
+  public:
+    struct State;
+    explicit Lines(std::unique_ptr<State> st);
+    Lines(Lines &&) noexcept;
+    Lines &operator=(Lines &&other) noexcept;
+    ~Lines() noexcept;
+
+    class iterator
+    {
+      Lines *l_ = nullptr; // nullptr = at the end
+
+    public:
+      using iterator_concept = std::input_iterator_tag;
+      using value_type = std::string_view;
+      using difference_type = std::ptrdiff_t;
+
+      iterator() = default;
+      explicit iterator(Lines *l) : l_(l) {}
+      std::string_view operator*() const { return l_->cur_; }
+      iterator &operator++()
+      {
+        if (!l_->next())
+          l_ = nullptr;
+        return *this;
+      }
+      void operator++(int) { ++*this; }
+      friend bool operator==(const iterator &it, std::default_sentinel_t) { return !it.l_; }
+    };
+
+    iterator begin(); // single pass: reads up to the first line
+    std::default_sentinel_t end() const { return {}; }
+    Result result();  // waits for the stages; stdout not iterated yet is drained and dropped
+
+  private:
+    std::unique_ptr<State> st_;
+    std::string_view cur_;
+    bool next();
+  };
+
   // ——— Pipeline builder that runs on destruction unless .run() was called ———
   class Pending
   {
     Pipeline pl_;
-    std::ostream *out_;
-    std::ostream *err_;
+    Output out_;
+    Output err_;
     bool armed_ = true; // was executed_; true means "auto-run in dtor"
+    bool background_ = false; // ...detached rather than waited for (`&`)
 
   public:
-    Pending(Pipeline pl, std::ostream &out, std::ostream &err);
+    Pending(Pipeline pl, Output out, Output err);
 
     // Disarm moved-from, so its dtor won't auto-run
     Pending(Pending &&other) noexcept;
     Pending &operator=(Pending &&other) noexcept;
     ~Pending() noexcept;
-    Result run();
+    Result run(); // start().wait()
+    Job start();  // launch now, return without waiting
+    Lines lines(); // launch now, iterate stdout line by line (the sink's stdout is unused)
+    Background detach(); // launch now; the shared reaper collects it
+
+    // Modifiers; they return the pipeline so calls chain: (CC % "a").spawn(Spawn::Fork) | "b"
+    Pending &&spawn(Spawn s);
+    Pending &&capture(Capture c);
+    Pending &&env(Env e);                                        // replace the environment
+    Pending &&env(std::string_view key, std::string_view value); // ours (or the block so far) + K=V
+    Pending &&clear_env();                                       // start from an empty block
+    Pending &&cwd(std::string path);                             // chdir in each child before exec
+    Pending &&timeout(std::chrono::milliseconds d, std::chrono::milliseconds grace = std::chrono::seconds(2));
+    Pending &&cancel_on(CancelToken t);
+    Pending &&pipefail(bool on = true);
+    Pending &&stats(bool on = true); // timings, CPU, RSS and bytes pumped in Result::stats
+    Pending &&in_background(); // auto-run detached at the end of the expression, like `&`
+    Pending &&err(Stderr s); // stderr of the stage added last: (CC % "make").err(Stderr::Merge) | "grep -i error"
+    // run() only (and the auto-run); start(), lines(), detach() and Runner run it once, as is
+    Pending &&retry(Retry r);
+    Pending &&cache(std::chrono::milliseconds ttl); // see clear_cache()
+    Pending &&refresh(); // bypass the cache this time and store the new Result
+
     friend Pending operator|(Pending &&p, std::string_view rhs);
+    friend Pending operator|(Pending &&p, const Cmd &rhs);
+    friend Pending operator|(Pending &&p, Filter f);
+    friend class Runner;
+  };
+
+  // ——— Result cache ———
+  // A cached run is keyed by every stage's argv (after $VAR expansion), the environment, the
+  // cwd and the stdin payload, all compared in full; a hit replays the stdout/stderr the first run wrote
+  // into the sinks and returns its Result without spawning. Only runs that exited 0 are kept;
+  // runs with in-process stages are never cached, since filters can't be compared.
+  void clear_cache();                   // drop every entry: the next run of each spawns again
+  void set_cache_limit(size_t entries); // default 256; past it the entry expiring first goes
+
+  // ——— Runner: back-to-back runs without the per-run allocations ———
+  // Keeps one job's state (stage tables, pipe/stdio plans, the read buffer, the Result's
+  // vectors) and reuses it for the next pipeline, so once warmed up a run allocates only
+  // what the children need (argv/envp live in the Cmds and Env). Not thread-safe: use one
+  // per thread, e.g. Runner::local(). Pipes aren't pooled: each run gets fresh ones, since
+  // EOF on a pipe can't be undone and a stage may still hold a copy.
+  class Runner
+  {
+    std::unique_ptr<detail::JobState> st_;
+
+  public:
+    Runner();
+    Runner(Runner &&) noexcept;
+    Runner &operator=(Runner &&) noexcept;
+    ~Runner();
+
+    const Result &run(Pending &&p); // like p.run(); the Result is valid until the next run()
+    static Runner &local();         // this thread's
+  };
+
+  // ——— co_await support: `Result r = co_await (CC % "cmd" | "grep x");` ———
+  // The pipeline is started in await_suspend() and completed by shpp's reactor thread
+  // (one epoll loop over Job::fd() for all awaiters), which is also where the coroutine
+  // resumes; hop to your own executor afterwards if that matters.
+  class Awaitable
+  {
+    Pending p_;
+    std::optional<Job> job_;
+    std::optional<Result> res_;
+    std::exception_ptr error_;
+
+  public:
+    explicit Awaitable(Pending &&p);
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h);
+    Result await_resume();
+  };
+  inline Awaitable operator co_await(Pending &&p)
+  {
+    return Awaitable(std::move(p));
+  }
+
+  // ——— Fan-out: many pipelines, at most max_concurrency running at once ———
+  // All pumping happens on the calling thread (one poll over the jobs' fds); no thread per child.
+  enum class Order
+  {
+    Completion, // on_done fires as soon as a pipeline finishes
+    Submission, // on_done fires in input order (later finishers are held back)
   };
+  using OnDone = std::function<void(size_t index, const Result &)>;
+
+  std::vector<Result> parallel(std::vector<Pending> &&jobs,
+                               size_t max_concurrency,
+                               OnDone on_done = {},
+                               Order order = Order::Completion); // results[i] belongs to jobs[i]
+
+  template <std::ranges::input_range R>
+    requires std::same_as<std::ranges::range_value_t<R>, Pending>
+  std::vector<Result> parallel(R &&jobs, size_t max_concurrency, OnDone on_done = {}, Order order = Order::Completion)
+  {
+    std::vector<Pending> v;
+    for (auto &p : jobs)
+      v.push_back(std::move(p));
+    return parallel(std::move(v), max_concurrency, std::move(on_done), order);
+  }
+
+  namespace detail
+  {
+    // Calls on_ready() from the reactor thread whenever fd is readable, until it returns true
+    void watch(int fd, std::function<bool()> on_ready);
+  } // namespace detail
 
   // ——— Top-level operators ———
   inline Pending operator%(CC_t, std::string_view cmd)
@@ -135,6 +1007,12 @@ namespace shpp
     pl.stages.push_back(Cmd::parse(cmd));
     return Pending(std::move(pl), ss.out, ss.err);
   }
+  inline Pending operator%(NN_t, std::string_view cmd)
+  {
+    Pipeline pl;
+    pl.stages.push_back(Cmd::parse(cmd));
+    return Pending(std::move(pl), to_null(), to_null());
+  }
 
   inline Pending operator%(CC_t, Input src)
   {
@@ -160,55 +1038,130 @@ namespace shpp
     pl.stdin_src = std::move(src);
     return Pending(std::move(pl), ss.out, ss.err);
   }
-
-  inline Pending operator&(CC_t, std::string_view cmd)
+  inline Pending operator%(NN_t, Input src)
   {
     Pipeline pl;
-    pl.stages.push_back(Cmd::parse(cmd));
+    pl.stdin_src = std::move(src);
+    return Pending(std::move(pl), to_null(), to_null());
+  }
+
+  // Precompiled commands / pipelines: no re-parsing, however often they run
+  inline Pending operator%(CC_t, Pipeline pl)
+  {
     return Pending(std::move(pl), std::cout, std::cerr);
   }
-  inline Pending operator&(SC_t sc, std::string_view cmd)
+  inline Pending operator%(SC_t sc, Pipeline pl)
   {
-    Pipeline pl;
-    pl.stages.push_back(Cmd::parse(cmd));
     return Pending(std::move(pl), sc.out, std::cerr);
   }
-  inline Pending operator&(CS_t cs, std::string_view cmd)
+  inline Pending operator%(CS_t cs, Pipeline pl)
   {
-    Pipeline pl;
-    pl.stages.push_back(Cmd::parse(cmd));
     return Pending(std::move(pl), std::cout, cs.err);
   }
-  inline Pending operator&(SS_t ss, std::string_view cmd)
+  inline Pending operator%(SS_t ss, Pipeline pl)
   {
-    Pipeline pl;
-    pl.stages.push_back(Cmd::parse(cmd));
     return Pending(std::move(pl), ss.out, ss.err);
   }
-
-  inline Pending operator&(CC_t, Input src)
+  inline Pending operator%(NN_t, Pipeline pl)
+  {
+    return Pending(std::move(pl), to_null(), to_null());
+  }
+  inline Pending operator%(CC_t cc, const Cmd &cmd)
   {
     Pipeline pl;
-    pl.stdin_src = std::move(src);
-    return Pending(std::move(pl), std::cout, std::cerr);
+    pl.stages.push_back(cmd);
+    return cc % std::move(pl);
   }
-  inline Pending operator&(SC_t sc, Input src)
+  inline Pending operator%(SC_t sc, const Cmd &cmd)
   {
     Pipeline pl;
-    pl.stdin_src = std::move(src);
-    return Pending(std::move(pl), sc.out, std::cerr);
+    pl.stages.push_back(cmd);
+    return sc % std::move(pl);
   }
-  inline Pending operator&(CS_t cs, Input src)
+  inline Pending operator%(CS_t cs, const Cmd &cmd)
   {
     Pipeline pl;
-    pl.stdin_src = std::move(src);
-    return Pending(std::move(pl), std::cout, cs.err);
+    pl.stages.push_back(cmd);
+    return cs % std::move(pl);
   }
-  inline Pending operator&(SS_t ss, Input src)
+  inline Pending operator%(SS_t ss, const Cmd &cmd)
   {
     Pipeline pl;
-    pl.stdin_src = std::move(src);
-    return Pending(std::move(pl), ss.out, ss.err);
+    pl.stages.push_back(cmd);
+    return ss % std::move(pl);
+  }
+  inline Pending operator%(NN_t nn, const Cmd &cmd)
+  {
+    Pipeline pl;
+    pl.stages.push_back(cmd);
+    return nn % std::move(pl);
+  }
+
+  // `&` builds the same pipeline as `%` but detaches it at the end of the full expression
+  // instead of waiting: NN & "updatedb"; (`&` binds looser than `|`, so for more stages
+  // write (CC % "a" | "b").in_background(), or .detach() to keep a handle)
+  inline Pending operator&(CC_t cc, std::string_view cmd)
+  {
+    return (cc % cmd).in_background();
+  }
+  inline Pending operator&(SC_t sc, std::string_view cmd)
+  {
+    return (std::move(sc) % cmd).in_background();
+  }
+  inline Pending operator&(CS_t cs, std::string_view cmd)
+  {
+    return (std::move(cs) % cmd).in_background();
+  }
+  inline Pending operator&(SS_t ss, std::string_view cmd)
+  {
+    return (std::move(ss) % cmd).in_background();
+  }
+  inline Pending operator&(NN_t nn, std::string_view cmd)
+  {
+    return (nn % cmd).in_background();
+  }
+
+  inline Pending operator&(CC_t cc, Input src)
+  {
+    return (cc % std::move(src)).in_background();
+  }
+  inline Pending operator&(SC_t sc, Input src)
+  {
+    return (std::move(sc) % std::move(src)).in_background();
+  }
+  inline Pending operator&(CS_t cs, Input src)
+  {
+    return (std::move(cs) % std::move(src)).in_background();
+  }
+  inline Pending operator&(SS_t ss, Input src)
+  {
+    return (std::move(ss) % std::move(src)).in_background();
+  }
+  inline Pending operator&(NN_t nn, Input src)
+  {
+    return (nn % std::move(src)).in_background();
+  }
+
+  // ——— xargs: one argument list too long for a single exec, run as several ———
+  // Runs cmd.batches(keep), at most max_concurrency at a time, each with mode's sinks
+  // (CC, NN, SC{to_file(...)}, ...); outputs of batches running together interleave by chunk.
+  // A to_file sink is opened once (so `>` truncates once) and shared by the batches as an fd.
+  namespace detail
+  {
+    Output shared_sink(const Output &o, Fd &file); // o, or to_fd() of the file it names, opened into `file`
+  }
+  template <class Mode>
+  std::vector<Result> xargs(Mode mode, const Cmd &cmd, size_t keep = 1, size_t max_concurrency = 1)
+  {
+    detail::Fd out_file, err_file;
+    if constexpr (requires { mode.out; })
+      mode.out = detail::shared_sink(mode.out, out_file);
+    if constexpr (requires { mode.err; })
+      mode.err = detail::shared_sink(mode.err, err_file);
+    std::vector<Pending> jobs;
+    for (const Cmd &c : cmd.batches(keep))
+      jobs.push_back(mode % c);
+    return parallel(std::move(jobs), max_concurrency);
   }
 
   using SC = SC_t;
@@ -1,9 +1,35 @@
 #include <shpp/shpp.hpp>
+#include <chrono>
+#include <future>
+#include <poll.h>
 #include <sstream>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <thread>
+
+// Just enough of a coroutine type to co_await a pipeline from main()
+struct Detached
+{
+  struct promise_type
+  {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+static Detached exit_code_of(shpp::Pending p, std::promise<int> &done)
+{
+  shpp::Result r = co_await std::move(p); // resumed on shpp's reactor thread
+  done.set_value(r.exit_code);
+}
 
 int main()
 {
   using namespace shpp;
+  start_spawn_server(); // first thing: the helper may only be forked while we have one thread
 
   // Console: stdout->cout, stderr->cerr
   std::cout << "\n---------------------\n";
@@ -32,6 +58,15 @@ int main()
     std::cout << "Err: " << err.str();
   }
 
+  {
+    // Straight into strings, no ostream
+    std::cout << "\n---------------------\n";
+    std::string out, err;
+    SS{into(out), into(err)} % R"(bash -lc 'echo hello; echo oops 1>&2')";
+    std::cout << "Out: " << out;
+    std::cout << "Err: " << err;
+  }
+
   {
     std::cout << "\n---------------------\n";
     std::ostringstream err;
@@ -39,6 +74,272 @@ int main()
     std::cout << "Err: " << err.str();
   }
 
+  // Tokenized at compile time
+  std::cout << "\n---------------------\n";
+  CC % "ls -ltc"_cmd | "grep main"_cmd;
+
+  // Classic fork() backend instead of posix_spawn
+  std::cout << "\n---------------------\n";
+  (CC % "ls -ltc" | "grep main").spawn(Spawn::Fork);
+
+  {
+    // Launched by the spawn server; an exec failure comes back as 127 like anywhere else
+    std::cout << "\n---------------------\n";
+    std::string out;
+    Result ok = (SC{into(out)} % "ls -ltc" | "grep main").spawn(Spawn::Server).run();
+    Result bad = (NN % "true" | "nonexistent-xyz").spawn(Spawn::Server).run();
+    std::cout << "Out: " << out << "codes: " << ok.exit_code << " " << bad.exit_code << "\n";
+
+    // `yes` dies of SIGPIPE once head is done, as it would under any other backend
+    out.clear();
+    Result yes = (SC{into(out)} % "yes" | "head -n 2").spawn(Spawn::Server).run();
+    std::cout << "Out: " << out << "code: " << yes.exit_code << " signal: " << WTERMSIG(yes.stage_statuses[0])
+              << "\n"; // 0 13
+
+    // Our cwd (and environment) go with every request, not the server's from startup
+    char *here = ::getcwd(nullptr, 0);
+    out.clear();
+    if (::chdir("/tmp") == 0)
+      (SC{into(out)} % "pwd").spawn(Spawn::Server).run();
+    std::cout << "Out: " << out; // /tmp
+    if (here && ::chdir(here) != 0)
+      std::cout << "Err: can't go back to " << here << "\n";
+    ::free(here);
+  }
+
+  {
+    // Shell-style redirections: > file, < file
+    std::cout << "\n---------------------\n";
+    SC{to_file("/tmp/shpp-ls.txt")} % "ls -ltc";
+    std::ostringstream out;
+    SC{out} % in_file("/tmp/shpp-ls.txt") | "grep main";
+    std::cout << "Out: " << out.str();
+  }
+
+  {
+    // stdin from /dev/null or closed outright, stdout to /dev/null: nothing waits on the terminal
+    std::cout << "\n---------------------\n";
+    std::string out;
+    Result empty = (SC{into(out)} % in_null() | "cat").run();
+    Result closed = (SC{into(out)} % in_closed() | "cat").err(Stderr::Null).run(); // cat: -: Bad file descriptor
+    NN % "seq 1 100000";
+    std::cout << "Out: [" << out << "] codes: " << empty.exit_code << " " << (closed.exit_code != 0) << "\n"; // [] 0 1
+  }
+
+  {
+    // Per-pipeline environment and working directory; ours are left alone
+    std::cout << "\n---------------------\n";
+    std::string out;
+    (SC{into(out)} % "printenv SHPP_DEMO").env("SHPP_DEMO", "hi").run();
+    (SC{into(out)} % "pwd").cwd("/tmp").run();
+    (SC{into(out)} % "env" | "wc -l" | "tr -d ' '").clear_env().run();
+    std::cout << "Out: " << out; // hi, /tmp, 0
+  }
+
+  {
+    // Streaming sinks: a callback per chunk read, or per complete line
+    std::cout << "\n---------------------\n";
+    size_t bytes = 0, lines = 0;
+    SC{on_chunk([&](std::string_view c) { bytes += c.size(); })} % "seq 1 10000";
+    SC{on_line([&](std::string_view) { ++lines; })} % "seq 1 10000";
+    std::cout << "bytes: " << bytes << " lines: " << lines << "\n"; // 48894 10000
+  }
+
+  {
+    // Per-stage stderr: 2>&1 into the pipe, captured into the Result, or 2>/dev/null
+    std::cout << "\n---------------------\n";
+    std::string out;
+    (SC{into(out)} % "sh -c 'echo merged >&2'").err(Stderr::Merge) | "tr a-z A-Z";
+    Result r = ((SC{into(out)} % "sh -c 'echo captured >&2; echo through'").err(Stderr::Capture) |
+                "sh -c 'cat; echo dropped >&2'")
+                   .err(Stderr::Null)
+                   .run();
+    std::cout << "Out: " << out << "stage_err[0]: " << r.stage_err[0];
+  }
+
+  {
+    // Instrumentation: per-run stats on request, or every Result through a hook
+    std::cout << "\n---------------------\n";
+    std::string out;
+    Result r = (SC{into(out)} % "seq 1 1000" | "tail -n 1").stats().run();
+    std::cout << "stages: " << r.stats->stages.size() << " bytes_out: " << r.stats->bytes_out << "\n"; // 2 5
+    int seen = 0;
+    set_metrics_hook([&](const Pipeline &, const Result &res) { seen += res.stats.has_value(); });
+    NN % "true";
+    NN % "true" | "true";
+    set_metrics_hook({});
+    NN % "true";
+    std::cout << "hook calls: " << seen << "\n"; // 2
+  }
+
+  {
+    // argv built without parsing, and split like xargs when it won't fit one exec
+    std::cout << "\n---------------------\n";
+    std::vector<std::string> words;
+    for (int i = 0; i < 300000; ++i)
+      words.push_back("word" + std::to_string(i));
+    Cmd echo = cmd("echo").arg("-n").args(std::vector<std::string>{"a", "b", "c"});
+    std::cout << "batches: " << echo.batches(2, 48).size() << "\n"; // "echo -n" + one word each: 3
+    std::vector<Result> rs = xargs(SC{to_file("/tmp/shpp-words.txt")}, cmd("printf").arg("%s\\n").args(words), 2);
+    std::string lines;
+    SC{into(lines)} % in_file("/tmp/shpp-words.txt") | "wc -l" | "tr -d ' '";
+    std::cout << "batches: " << rs.size() << " lines: " << lines; // every batch, not just the last
+  }
+
+  {
+    // Runner: the same job state, refilled for each run
+    std::cout << "\n---------------------\n";
+    Runner &r = Runner::local();
+    std::string out;
+    const Result *first = &r.run(SC{into(out)} % "echo one" | "cat");
+    const int bad = r.run(NN % "nonexistent-xyz").exit_code;
+    const Result *third = &r.run(SC{into(out)} % "echo three" | "cat" | "cat");
+    std::cout << "Out: " << out << "codes: " << bad << " " << third->exit_code << " stages: " << third->stage_statuses.size()
+              << " same Result: " << (first == third) << "\n"; // 127 0 3 1
+  }
+
+  {
+    // Start now, collect later
+    std::cout << "\n---------------------\n";
+    std::ostringstream out, err;
+    Job job = (SS{out, err} % "ls -ltc" | "grep main").start();
+    std::cout << "pids: " << job.pids().size() << "\n";
+    Job moved = std::move(job);
+    std::cout << "code: " << moved.wait().exit_code << "\n";
+    std::cout << "Out: " << out.str();
+    try
+    {
+      job.wait(); // moved from: throws instead of touching a null state
+    }
+    catch (const std::logic_error &e)
+    {
+      std::cout << "Err: " << e.what() << "\n";
+    }
+  }
+
+  {
+    // A stage that can't be started counts as exited with 127; fd() still wakes the poller
+    std::cout << "\n---------------------\n";
+    Job job = (NN % "true" | "nonexistent-xyz").start();
+    std::optional<Result> res;
+    while (!(res = job.try_wait()))
+    {
+      pollfd p{job.fd(), POLLIN, 0};
+      ::poll(&p, 1, p.fd >= 0 ? -1 : 10);
+    }
+    std::cout << "code: " << res->exit_code << "\n"; // 127
+  }
+
+  {
+    // So does an empty Cmd, on every backend
+    std::cout << "\n---------------------\n";
+    for (Spawn how : {Spawn::Auto, Spawn::Fork, Spawn::Server})
+    {
+      Pipeline pl;
+      pl.stages.emplace_back();
+      pl.spawn = how;
+      std::cout << "code: " << (NN % pl).run().exit_code << "\n"; // 127
+    }
+  }
+
+  {
+    // In-process stages, and pulling lines: no grep/head/wc processes are forked
+    std::cout << "\n---------------------\n";
+    std::string out;
+    SC{into(out)} % "seq 1000" | grep("7") | head(3);
+    std::cout << "Out: " << out; // 7 17 27
+    out.clear();
+    Result n = (SC{into(out)} % "seq 1000" | count_lines()).run();
+    std::cout << "Out: " << out << "code: " << n.exit_code << "\n";
+    for (std::string_view line : (CC % "ls -ltc").lines())
+      if (line.find("main") != std::string_view::npos)
+        std::cout << "Line: " << line << "\n";
+
+    out.clear();
+    Result bad = (SC{into(out)} % "nonexistent-xyz" | count_lines()).run();
+    std::cout << "Out: " << out << "code: " << bad.exit_code << "\n"; // 0 lines, 127
+    size_t lines = 0;
+    for (std::string_view line : (CC % "nonexistent-xyz").lines())
+      lines += !line.empty();
+    std::cout << "lines: " << lines << "\n"; // the range just ends
+  }
+
+  {
+    // Timeouts, cancellation and pipefail: the stages' group gets SIGTERM, then SIGKILL
+    using namespace std::chrono_literals;
+    std::cout << "\n---------------------\n";
+    Result slow = (CC % "sleep 5").timeout(100ms, 100ms).run();
+    std::cout << "timed_out: " << slow.timed_out << " code: " << slow.exit_code << "\n"; // 143
+
+    CancelToken stop;
+    Job job = (CC % "sleep 5").cancel_on(stop).start();
+    std::thread([stop] {
+      std::this_thread::sleep_for(50ms);
+      stop.cancel();
+    }).detach();
+    std::cout << "cancelled: " << job.wait().cancelled << "\n";
+
+    Result pf = (NN % "sh -c 'exit 3'" | "sleep 5").pipefail().run(); // sleep is cut short
+    std::cout << "failed_stage: " << pf.failed_stage << " code: " << pf.exit_code << "\n"; // 0 3
+
+    Result gone = (NN % "nonexistent-xyz" | "sleep 5").pipefail().timeout(5s).run();
+    std::cout << "failed_stage: " << gone.failed_stage << " code: " << gone.exit_code << "\n"; // 0 127
+  }
+
+  {
+    // Retries with backoff, and a result cache for read-only commands
+    using namespace std::chrono_literals;
+    std::cout << "\n---------------------\n";
+    std::string first, again;
+    (SC{into(first)} % "date +%N").cache(10s);
+    Result hit = (SC{into(again)} % "date +%N").cache(10s).run(); // same output, nothing spawned
+    std::cout << "same: " << (first == again) << " cached: " << hit.cached << "\n";
+    clear_cache();
+
+    Result flaky = (NN % "sh -c 'exit 1'").retry({.attempts = 3, .delay = 10ms}).run();
+    std::cout << "attempts: " << flaky.attempts << " code: " << flaky.exit_code << "\n"; // 3 1
+
+    Result gone = (NN % "nonexistent-xyz").retry({.attempts = 2, .delay = 10ms}).cache(10s).run();
+    Result still = (NN % "nonexistent-xyz").cache(10s).run(); // failures aren't cached
+    std::cout << "attempts: " << gone.attempts << " code: " << gone.exit_code << " cached: " << still.cached
+              << "\n"; // 2 127 0
+  }
+
+  {
+    // Fan-out: at most 2 at a time; results come back in input order
+    std::cout << "\n---------------------\n";
+    std::vector<std::string> outs(3);
+    std::vector<Pending> jobs;
+    jobs.push_back(SC{into(outs[0])} % "echo one");
+    jobs.push_back(SC{into(outs[1])} % "echo two" | "tr a-z A-Z");
+    jobs.push_back(NN % "true" | "nonexistent-xyz"); // exec failure: 127, not a hang
+    std::vector<Result> rs = parallel(std::move(jobs), 2);
+    std::cout << "Out: " << outs[0] << "Out: " << outs[1];
+    std::cout << "codes: " << rs[0].exit_code << " " << rs[1].exit_code << " " << rs[2].exit_code << "\n";
+  }
+
+  {
+    // co_await: the pipeline runs while the coroutine is suspended
+    std::cout << "\n---------------------\n";
+    std::promise<int> ok, failed;
+    exit_code_of(CC % "echo awaited", ok);
+    exit_code_of(CC % "true" | "nonexistent-xyz", failed); // resumes with 127
+    std::cout << "codes: " << ok.get_future().get() << " " << failed.get_future().get() << "\n";
+  }
+
+  {
+    // Detached: the shared reaper collects them; wait() on a handle if you need the Result
+    std::cout << "\n---------------------\n";
+    std::string out;
+    Background bg = (SC{into(out)} % "echo detached").detach();
+    std::cout << "code: " << bg.wait().exit_code << " Out: " << out;
+    std::cout << "code: " << (NN % "nonexistent-xyz").detach().wait().exit_code << "\n"; // 127
+    set_background_limit(2);
+    for (int i = 0; i < 8; ++i)
+      NN & "nonexistent-xyz"; // each frees its slot at once, so none of these blocks
+    set_background_limit(256);
+  }
+
   // Get the exit code explicitly
   std::cout << "\n---------------------\n";
   auto r = (CC % "bash -lc \"echo ok && false\""); // last cmd's status